@@ -0,0 +1,267 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kfbclient.h"
+
+// false if the connection failed, rsp->status is only valid after a complete response
+static bool request(RemoteHandle* s, int op, const char* path, KfbdResponse* rsp, string* payload,
+                    int level = 0, int x = 0, int y = 0, int width = 0, int height = 0) {
+    KfbdRequest req;
+    memset(&req, 0, sizeof(req));
+    req.op = op;
+    req.level = level;
+    req.x = x;
+    req.y = y;
+    req.width = width;
+    req.height = height;
+    if(path) strncpy(req.path, path, KFBD_PATH_MAX - 1);
+    // another thread's response must not be read as ours
+    lock_guard<mutex> guard(s->lock);
+    bool sent = op == KFBD_OP_HELLO ? kfbd_send_fd(s->fd, &req, sizeof(req), s->ringFd)
+                                    : kfbd_write_full(s->fd, &req, sizeof(req));
+    if(!sent || !kfbd_read_full(s->fd, rsp, sizeof(*rsp))) {
+        printf("%s\n", "Error: lost connection to kfbdaemon.");
+        return false;
+    }
+    string extra(rsp->payloadBytes, '\0');
+    if(rsp->payloadBytes && !kfbd_read_full(s->fd, &extra[0], extra.size())) {
+        printf("%s\n", "Error: lost connection to kfbdaemon.");
+        return false;
+    }
+    if(payload) *payload = extra;
+    return true;
+}
+
+// "a\0b\0c\0" -> {"a", "b", "c"}
+static vector<string> splitPayload(const string& payload) {
+    vector<string> items;
+    size_t pos = 0;
+    while(pos < payload.size()) {
+        size_t end = payload.find('\0', pos);
+        if(end == string::npos) end = payload.size();
+        items.push_back(payload.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return items;
+}
+
+static bool createRing(RemoteHandle* s) {
+    uint32_t nSlots = KFBD_DEFAULT_SLOTS, slotSize = KFBD_DEFAULT_SLOT_SIZE, dataOffset = 0;
+    if(getenv("KFBD_RING_SLOTS")) nSlots = min(KFBD_MAX_SLOTS, max(1, atoi(getenv("KFBD_RING_SLOTS"))));
+    if(getenv("KFBD_SLOT_SIZE")) slotSize = max(4096, atoi(getenv("KFBD_SLOT_SIZE")));
+    size_t bytes = kfbd_ring_bytes(nSlots, slotSize, &dataOffset);
+
+    // kfbdaemon only maps rings whose size is sealed
+    int fd = memfd_create("kfbclient.ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(fd < 0) return false;
+    void* ptr = MAP_FAILED;
+    if(ftruncate(fd, bytes) == 0 && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0)
+        ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(ptr == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    s->ringFd = fd;
+    s->ring = (KfbdRingHeader*)ptr;
+    s->ringBytes = bytes;
+    s->data = (BYTE*)ptr + dataOffset;
+    s->ring->magic = KFBD_RING_MAGIC;
+    s->ring->nSlots = nSlots;
+    s->ring->slotSize = slotSize;
+    s->ring->dataOffset = dataOffset;
+    for(uint32_t i = 0; i < KFBD_MAX_SLOTS; i++) s->ring->state[i].store(KFBD_SLOT_FREE);
+    return true;
+}
+
+static void releaseRemote(RemoteHandle* s) {
+    if(s->fd >= 0) close(s->fd);
+    if(s->ringFd >= 0) close(s->ringFd);
+    if(s->ring) munmap(s->ring, s->ringBytes);
+    delete s;
+}
+
+RemoteHandle* kfbclient_open(const char* socketPath, const char* filename) {
+    if(!socketPath) socketPath = getenv("KFBD_SOCKET");
+    if(!socketPath) socketPath = KFBD_DEFAULT_SOCKET;
+    sockaddr_un addr;
+    if(!filename || strlen(filename) >= KFBD_PATH_MAX || !kfbd_socket_addr(socketPath, &addr)) return nullptr;
+
+    RemoteHandle* s = new RemoteHandle;
+    s->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(s->fd < 0 || connect(s->fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Error: cannot connect to kfbdaemon at %s\n", socketPath);
+        releaseRemote(s);
+        return nullptr;
+    }
+    if(!createRing(s)) {
+        releaseRemote(s);
+        return nullptr;
+    }
+    KfbdResponse rsp;
+    bool mapped = request(s, KFBD_OP_HELLO, nullptr, &rsp, nullptr) && rsp.status == KFBD_OK;
+    // daemon has mapped the ring (or given up), the descriptor is no longer needed
+    close(s->ringFd);
+    s->ringFd = -1;
+    string payload;
+    if(!mapped || !request(s, KFBD_OP_OPEN, filename, &rsp, &payload)) {
+        releaseRemote(s);
+        return nullptr;
+    }
+    if(rsp.status != KFBD_OK) {
+        if(rsp.status == KFBD_EACCESS) fprintf(stderr, "Error: kfbdaemon refused to open %s\n", filename);
+        releaseRemote(s);
+        return nullptr;
+    }
+    s->width = rsp.width;
+    s->height = rsp.height;
+    s->maxLevel = rsp.maxLevel;
+    s->scanScale = rsp.scanScale;
+    vector<string> items = splitPayload(payload);
+    for(size_t i = 0; i + 1 < items.size(); i += 2) {
+        s->properties[items[i]] = items[i + 1];
+        s->propertyKeys.push_back(items[i]);
+    }
+    for(string& key : s->propertyKeys) s->propertyNames.push_back(key.c_str());
+    s->propertyNames.push_back(nullptr);
+    return s;
+}
+
+void kfbclient_close(RemoteHandle* s) {
+    KfbdResponse rsp;
+    request(s, KFBD_OP_CLOSE, nullptr, &rsp, nullptr);
+    releaseRemote(s);
+}
+
+const char * kfbclient_detect_vendor(const char *) {
+    return "kfbio";
+}
+
+const char** kfbclient_property_names(RemoteHandle* s) {
+    return s->propertyNames.data();
+}
+
+const char * kfbclient_property_value(RemoteHandle* s, const char * attribute_name) {
+    auto iter = s->properties.find(attribute_name);
+    if(iter != s->properties.end()) return iter->second.c_str();
+    return nullptr;
+}
+
+/*
+    Level Related, same rules as kfbslide_*
+*/
+double kfbclient_get_level_downsample(RemoteHandle* s, int level) {
+    if(s->maxLevel > level && level >= 0) return double(1LL << level);
+    return 0.0;
+}
+
+int kfbclient_get_best_level_for_downsample(RemoteHandle* s, double downsample) {
+    if(downsample < 1) return 0;
+    for(int i = 0; i < s->maxLevel; i++) {
+        if((1LL << (i + 1)) > downsample) return i;
+    }
+    return s->maxLevel - 1;
+}
+
+int kfbclient_get_level_count(RemoteHandle* s) {
+    return s->maxLevel;
+}
+
+ll kfbclient_get_level_dimensions(RemoteHandle* s, int level, ll* width, ll* height) {
+    if(level >= s->maxLevel || level < 0) return 0;
+    if(!width || !height) {
+        printf("You must pass width and height ptr ByRef!");
+        return 0;
+    }
+    *width = s->width >> level;
+    *height = s->height >> level;
+    return *height;
+}
+
+/*
+    Associated Image
+*/
+const char** kfbclient_get_associated_image_names(RemoteHandle* s) {
+    lock_guard<mutex> guard(s->assoLock);
+    if(!s->assoLoaded) {
+        KfbdResponse rsp;
+        string payload;
+        if(request(s, KFBD_OP_ASSO_NAMES, nullptr, &rsp, &payload) && rsp.status == KFBD_OK) s->assoKeys = splitPayload(payload);
+        for(string& key : s->assoKeys) s->assoNames.push_back(key.c_str());
+        s->assoNames.push_back(nullptr);
+        s->assoLoaded = true;
+    }
+    return s->assoNames.data();
+}
+
+void kfbclient_get_associated_image_dimensions(RemoteHandle* s, const char* name, ll* width, ll*height, ll*nBytes) {
+    if(!width || !height || !nBytes) {
+        printf("You must pass width, height and nBytes ptr ByRef!");
+        return;
+    }
+    KfbdResponse rsp;
+    if(!request(s, KFBD_OP_ASSO_DIMS, name, &rsp, nullptr) || rsp.status != KFBD_OK) {
+        *width = *height = *nBytes = 0;
+        return;
+    }
+    *width = rsp.width;
+    *height = rsp.height;
+    *nBytes = rsp.nBytes;
+}
+
+static BYTE* slotData(RemoteHandle* s, const KfbdResponse& rsp) {
+    if(rsp.slot < 0 || (uint32_t)rsp.slot >= s->ring->nSlots) return nullptr;
+    return s->data + (size_t)rsp.slot * s->ring->slotSize;
+}
+
+static bool readImage(RemoteHandle* s, KfbdResponse& rsp) {
+    if(rsp.status == KFBD_ENOSLOT)
+        printf("%s\n", "Error: kfbclient ring is full, free some buffers first.");
+    else if(rsp.status == KFBD_ETOOBIG)
+        printf("Error: image of %d bytes does not fit into a ring slot, raise KFBD_SLOT_SIZE.\n", rsp.nBytes);
+    return rsp.status == KFBD_OK && slotData(s, rsp);
+}
+
+BYTE* kfbclient_read_associated_image(RemoteHandle* s, const char* name) {
+    KfbdResponse rsp;
+    if(!request(s, KFBD_OP_ASSO_READ, name, &rsp, nullptr) || !readImage(s, rsp)) return nullptr;
+    return slotData(s, rsp);
+}
+
+/*
+    Load Data
+*/
+bool kfbclient_read_region(RemoteHandle* s, int level, int x, int y, int* nBytes, BYTE** buf) {
+    if(!buf || !nBytes) {
+        printf("You must pass nBytes and buf ptr ByRef!");
+        return false;
+    }
+    KfbdResponse rsp;
+    if(!request(s, KFBD_OP_READ_REGION, nullptr, &rsp, nullptr, level, x, y) || !readImage(s, rsp)) return false;
+    *buf = slotData(s, rsp);
+    *nBytes = rsp.nBytes;
+    return *nBytes > 0;
+}
+
+bool kfbclient_get_image_roi_stream(RemoteHandle* s, int level, int x, int y, int width, int height, int* nBytes, BYTE** buf) {
+    if(!buf || !nBytes) {
+        printf("You must pass nBytes and buf ptr ByRef!");
+        return false;
+    }
+    KfbdResponse rsp;
+    if(!request(s, KFBD_OP_ROI_STREAM, nullptr, &rsp, nullptr, level, x, y, width, height) || !readImage(s, rsp))
+        return false;
+    *buf = slotData(s, rsp);
+    *nBytes = rsp.nBytes;
+    return true;
+}
+
+/*
+    free resource
+*/
+bool kfbclient_buffer_free(RemoteHandle* s, BYTE* buf) {
+    if(!buf || buf < s->data) return false;
+    size_t offset = buf - s->data;
+    if(offset % s->ring->slotSize || offset / s->ring->slotSize >= s->ring->nSlots) return false;
+    uint32_t expected = KFBD_SLOT_BUSY;
+    return s->ring->state[offset / s->ring->slotSize].compare_exchange_strong(expected, KFBD_SLOT_FREE);
+}
@@ -0,0 +1,99 @@
+#ifndef __KFBCLIENT__
+#define __KFBCLIENT__
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <string>
+#include "kfbipc.h"
+
+using ll=long long int;
+using BYTE=unsigned char;
+using namespace std;
+
+// 客户端侧的切片句柄, 真正的 ImgHandle 在 kfbdaemon 中
+struct RemoteHandle {
+    int fd;
+    int ringFd;             // sealed memfd of the ring, passed to the daemon with HELLO
+    mutex lock;             // one request/response pair at a time on fd
+    mutex assoLock;
+    KfbdRingHeader* ring;
+    size_t ringBytes;
+    BYTE* data;
+    map<string, string> properties;
+    vector<string> propertyKeys;
+    vector<const char*> propertyNames;
+    vector<string> assoKeys;
+    vector<const char*> assoNames;
+    bool assoLoaded;
+    int maxLevel;
+    int scanScale;
+    int width;
+    int height;
+
+    RemoteHandle() {
+        fd = ringFd = -1;
+        ring = nullptr;
+        ringBytes = 0;
+        data = nullptr;
+        assoLoaded = false;
+        maxLevel = 0;
+        scanScale = 0;
+        width = height = 0;
+    }
+
+    ~RemoteHandle() = default;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/*
+ * The kfbclient_* functions mirror kfbslide_* but talk to a local kfbdaemon.
+ * Image buffers point into a shared memory ring and are not copied; each one
+ * holds a ring slot until kfbclient_buffer_free() or kfbclient_close().
+ * Like kfbslide_*, they may be called from several threads on one handle;
+ * the requests of one handle are sent one at a time.
+ */
+
+/**
+ * Connect to kfbdaemon and open a slide there.
+ *
+ * @param socketPath The daemon socket, NULL for $KFBD_SOCKET or KFBD_DEFAULT_SOCKET.
+ * @param filename The filename to open.
+ * @return A new handle, or NULL if the daemon is unreachable or failed to open the slide.
+ */
+RemoteHandle* kfbclient_open(const char* socketPath, const char* filename);
+
+void kfbclient_close(RemoteHandle* s);
+
+const char * kfbclient_detect_vendor(const char *);
+
+const char** kfbclient_property_names(RemoteHandle* s);
+
+const char * kfbclient_property_value(RemoteHandle* s, const char * attribute_name);
+
+double kfbclient_get_level_downsample(RemoteHandle* s, int level);
+
+int kfbclient_get_best_level_for_downsample(RemoteHandle* s, double downsample);
+
+int kfbclient_get_level_count(RemoteHandle* s);
+
+ll kfbclient_get_level_dimensions(RemoteHandle* s, int level, ll* width, ll* height);
+
+BYTE* kfbclient_read_associated_image(RemoteHandle* s, const char* name);
+
+void kfbclient_get_associated_image_dimensions(RemoteHandle* s, const char* name, ll* width, ll*height, ll*nBytes);
+
+const char** kfbclient_get_associated_image_names(RemoteHandle* s);
+
+bool kfbclient_read_region(RemoteHandle* s, int level, int x, int y, int* nBytes, BYTE** buf);
+
+bool kfbclient_get_image_roi_stream(RemoteHandle* s, int level, int x, int y, int width, int height, int* nBytes, BYTE** buf);
+
+// 归还 buf 所在的共享内存槽位, 之后 daemon 可以复用该槽位
+bool kfbclient_buffer_free(RemoteHandle* s, BYTE* buf);
+#ifdef __cplusplus
+}
+#endif
+#endif
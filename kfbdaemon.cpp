@@ -0,0 +1,313 @@
+#include <thread>
+#include <mutex>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kfbreader.h"
+#include "kfbipc.h"
+
+// 每个节点运行一个 kfbdaemon: 它持有 libImageOperationLib.so 与所有打开的 ImgHandle,
+// 多个进程打开同一张切片时只调用一次 kfbslide_open, 图像数据写入客户端的共享内存环
+
+// kfbslide_* serializes the vendor calls of one handle, clients of the same slide share it without a lock
+struct SlideEntry {
+    ImgHandle* s;
+    int refs;
+    ll lastUsed;
+};
+
+struct Connection {
+    int fd;
+    ucred peer;             // SO_PEERCRED of the client
+    KfbdRingHeader* ring;
+    size_t ringBytes;
+    BYTE* data;
+    // copies of the ring header checked in mapRing, the client may rewrite the shared header
+    uint32_t nSlots;
+    uint32_t slotSize;
+    uint32_t cursor;
+    SlideEntry* slide;
+};
+
+static const char* dllPath = nullptr;
+static mutex slidesLock;
+static map<string, SlideEntry*> slides;
+static ll useClock = 0;
+static size_t maxIdle = 16;
+
+static SlideEntry* acquireSlide(const string& filename) {
+    {
+        lock_guard<mutex> guard(slidesLock);
+        auto iter = slides.find(filename);
+        if(iter != slides.end()) {
+            iter->second->refs++;
+            iter->second->lastUsed = ++useClock;
+            return iter->second;
+        }
+    }
+    // kfbslide_open is slow, do not block other clients while it runs
+    ImgHandle* s = kfbslide_open(dllPath, filename.c_str());
+    if(!s) return nullptr;
+    lock_guard<mutex> guard(slidesLock);
+    auto iter = slides.find(filename);
+    if(iter != slides.end()) {
+        kfbslide_close(s);
+        iter->second->refs++;
+        iter->second->lastUsed = ++useClock;
+        return iter->second;
+    }
+    SlideEntry* e = new SlideEntry;
+    e->s = s;
+    e->refs = 1;
+    e->lastUsed = ++useClock;
+    slides[filename] = e;
+    return e;
+}
+
+// Unreferenced slides stay open so that the next job skips kfbslide_open,
+// until more than maxIdle of them pile up.
+static void releaseSlide(SlideEntry* e) {
+    lock_guard<mutex> guard(slidesLock);
+    e->refs--;
+    while(true) {
+        size_t idle = 0;
+        auto oldest = slides.end();
+        for(auto iter = slides.begin(); iter != slides.end(); iter++) {
+            if(iter->second->refs > 0) continue;
+            idle++;
+            if(oldest == slides.end() || iter->second->lastUsed < oldest->second->lastUsed) oldest = iter;
+        }
+        if(idle <= maxIdle) break;
+        kfbslide_close(oldest->second->s);
+        delete oldest->second;
+        slides.erase(oldest);
+    }
+}
+
+static int claimSlot(Connection& c) {
+    uint32_t n = c.nSlots;
+    for(uint32_t i = 0; i < n; i++) {
+        uint32_t k = (c.cursor + i) % n;
+        uint32_t expected = KFBD_SLOT_FREE;
+        if(c.ring->state[k].compare_exchange_strong(expected, KFBD_SLOT_BUSY)) {
+            c.cursor = k + 1;
+            return k;
+        }
+    }
+    return -1;
+}
+
+static void putSlot(Connection& c, const BYTE* buf, int nBytes, KfbdResponse& rsp) {
+    if(!buf || nBytes <= 0) {
+        rsp.status = KFBD_EFAIL;
+        return;
+    }
+    if((uint32_t)nBytes > c.slotSize) {
+        rsp.status = KFBD_ETOOBIG;
+        rsp.nBytes = nBytes;
+        return;
+    }
+    int slot = claimSlot(c);
+    if(slot < 0) {
+        rsp.status = KFBD_ENOSLOT;
+        return;
+    }
+    memcpy(c.data + (size_t)slot * c.slotSize, buf, nBytes);
+    rsp.status = KFBD_OK;
+    rsp.slot = slot;
+    rsp.nBytes = nBytes;
+}
+
+static bool mapRing(Connection& c, int fd) {
+    // a client that shrinks the ring after HELLO would make memcpy into a slot raise SIGBUS in the daemon
+    const int sealed = F_SEAL_SHRINK | F_SEAL_GROW;
+    struct stat st;
+    if(fd < 0 || (fcntl(fd, F_GET_SEALS) & sealed) != sealed || fstat(fd, &st) < 0
+       || (size_t)st.st_size < sizeof(KfbdRingHeader))
+        return false;
+    void* ptr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(ptr == MAP_FAILED) return false;
+    KfbdRingHeader* ring = (KfbdRingHeader*)ptr;
+    // read the header once, later changes by the client are ignored
+    const volatile uint32_t* fields = (const volatile uint32_t*)ptr;
+    uint32_t magic = fields[0], nSlots = fields[1], slotSize = fields[2], dataOffset = fields[3], expected = 0;
+    if(magic != KFBD_RING_MAGIC || nSlots == 0 || nSlots > KFBD_MAX_SLOTS
+       || kfbd_ring_bytes(nSlots, slotSize, &expected) > (size_t)st.st_size || dataOffset != expected) {
+        munmap(ptr, st.st_size);
+        return false;
+    }
+    c.ring = ring;
+    c.ringBytes = st.st_size;
+    c.data = (BYTE*)ptr + dataOffset;
+    c.nSlots = nSlots;
+    c.slotSize = slotSize;
+    return true;
+}
+
+static bool permitted(const struct stat& st, const ucred& peer, mode_t user, mode_t group, mode_t other) {
+    if(st.st_uid == peer.uid) return st.st_mode & user;
+    if(st.st_gid == peer.gid) return st.st_mode & group;
+    return st.st_mode & other;
+}
+
+// 其他用户的客户端只能打开它自己有权读取的切片: 按权限位检查路径上的目录和文件 (不含附加组与 ACL)
+static bool resolveSlide(const ucred& peer, const char* path, string& resolved) {
+    char* real = realpath(path, nullptr);
+    bool found = real != nullptr;
+    resolved = found ? real : path;
+    free(real);
+    if(peer.uid == 0 || peer.uid == geteuid()) return true;
+    if(!found) return false;
+    struct stat st;
+    for(size_t pos = resolved.find('/', 1); pos != string::npos; pos = resolved.find('/', pos + 1))
+        if(stat(resolved.substr(0, pos).c_str(), &st) < 0 || !permitted(st, peer, S_IXUSR, S_IXGRP, S_IXOTH)) return false;
+    return stat(resolved.c_str(), &st) == 0 && S_ISREG(st.st_mode) && permitted(st, peer, S_IRUSR, S_IRGRP, S_IROTH);
+}
+
+static void appendString(string& payload, const char* str) {
+    payload.append(str);
+    payload.push_back('\0');
+}
+
+static bool handle(Connection& c, KfbdRequest& req, int passedFd) {
+    KfbdResponse rsp;
+    memset(&rsp, 0, sizeof(rsp));
+    rsp.slot = -1;
+    string payload;
+    req.path[KFBD_PATH_MAX - 1] = '\0';
+
+    if(req.op == KFBD_OP_HELLO) {
+        if(c.ring || !mapRing(c, passedFd)) rsp.status = KFBD_EPROTO;
+    } else if(!c.ring) {
+        rsp.status = KFBD_EPROTO;
+    } else if(req.op == KFBD_OP_OPEN) {
+        string filename;
+        if(c.slide) rsp.status = KFBD_EPROTO;
+        else if(!resolveSlide(c.peer, req.path, filename)) rsp.status = KFBD_EACCESS;
+        else if(!(c.slide = acquireSlide(filename))) rsp.status = KFBD_EFAIL;
+        else {
+            ImgHandle* s = c.slide->s;
+            rsp.width = s->width;
+            rsp.height = s->height;
+            rsp.maxLevel = s->maxLevel;
+            rsp.scanScale = s->scanScale;
+            for(auto& kv : s->properties) {
+                appendString(payload, kv.first.c_str());
+                appendString(payload, kv.second.c_str());
+            }
+        }
+    } else if(!c.slide) {
+        rsp.status = KFBD_EPROTO;
+    } else {
+        ImgHandle* s = c.slide->s;
+        switch(req.op) {
+        case KFBD_OP_ASSO_NAMES: {
+            const char** names = kfbslide_get_associated_image_names(s);
+            for(; *names; names++) appendString(payload, *names);
+            break;
+        }
+        case KFBD_OP_ASSO_DIMS: {
+            ll w, h, nBytes;
+            kfbslide_get_associated_image_names(s);
+            kfbslide_get_associated_image_dimensions(s, req.path, &w, &h, &nBytes);
+            rsp.width = w;
+            rsp.height = h;
+            rsp.nBytes = nBytes;
+            break;
+        }
+        case KFBD_OP_ASSO_READ: {
+            ll w, h, nBytes;
+            kfbslide_get_associated_image_names(s);
+            kfbslide_get_associated_image_dimensions(s, req.path, &w, &h, &nBytes);
+            BYTE* buf = kfbslide_read_associated_image(s, req.path);
+            putSlot(c, buf, nBytes, rsp);
+            kfbslide_buffer_free(s, buf);
+            break;
+        }
+        case KFBD_OP_READ_REGION:
+        case KFBD_OP_ROI_STREAM: {
+            BYTE* buf = nullptr;
+            int nBytes = 0;
+            bool ok = req.op == KFBD_OP_READ_REGION
+                    ? kfbslide_read_region(s, req.level, req.x, req.y, &nBytes, &buf)
+                    : kfbslide_get_image_roi_stream(s, req.level, req.x, req.y, req.width, req.height, &nBytes, &buf);
+            if(ok) putSlot(c, buf, nBytes, rsp);
+            else rsp.status = KFBD_EFAIL;
+            kfbslide_buffer_free(s, buf);
+            break;
+        }
+        case KFBD_OP_CLOSE:
+            break;
+        default:
+            rsp.status = KFBD_EPROTO;
+        }
+    }
+
+    rsp.payloadBytes = payload.size();
+    if(!kfbd_write_full(c.fd, &rsp, sizeof(rsp))) return false;
+    if(!payload.empty() && !kfbd_write_full(c.fd, payload.data(), payload.size())) return false;
+    return req.op != KFBD_OP_CLOSE;
+}
+
+static void serve(int fd) {
+    Connection c;
+    memset(&c, 0, sizeof(c));
+    c.fd = fd;
+    socklen_t credBytes = sizeof(c.peer);
+    if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &c.peer, &credBytes) < 0) {
+        close(fd);
+        return;
+    }
+    KfbdRequest req;
+    int passedFd;
+    while(kfbd_read_full_fd(fd, &req, sizeof(req), &passedFd)) {
+        bool more = handle(c, req, passedFd);
+        if(passedFd >= 0) close(passedFd);
+        if(!more) break;
+    }
+    if(c.slide) releaseSlide(c.slide);
+    if(c.ring) munmap(c.ring, c.ringBytes);
+    close(fd);
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        printf("Usage: %s <libImageOperationLib.so> [socket path]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    dllPath = argv[1];
+    const char* socketPath = argc > 2 ? argv[2] : KFBD_DEFAULT_SOCKET;
+    if(getenv("KFBD_IDLE_SLIDES")) maxIdle = atoi(getenv("KFBD_IDLE_SLIDES"));
+    // only the daemon's user can connect by default, e.g. KFBD_SOCKET_MODE=660 shares it with the group
+    mode_t socketMode = getenv("KFBD_SOCKET_MODE") ? strtol(getenv("KFBD_SOCKET_MODE"), nullptr, 8) & 0777 : 0600;
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un addr;
+    if(!kfbd_socket_addr(socketPath, &addr)) {
+        printf("Error: socket path too long: %s\n", socketPath);
+        return EXIT_FAILURE;
+    }
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath);
+    // no other user may connect before chmod
+    mode_t mask = umask(0177);
+    bool bound = listenFd >= 0 && bind(listenFd, (sockaddr*)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if(!bound || chmod(socketPath, socketMode) < 0 || listen(listenFd, 64) < 0) {
+        perror("kfbdaemon");
+        return EXIT_FAILURE;
+    }
+    printf("kfbdaemon listening on %s\n", socketPath);
+    while(true) {
+        int fd = accept(listenFd, nullptr, nullptr);
+        if(fd < 0) {
+            if(errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+        thread(serve, fd).detach();
+    }
+    close(listenFd);
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+#include "kfbdecode.h"
+
+// libjpeg 默认的错误处理会直接 exit(), 这里改为 longjmp 回来返回 false
+struct JpegError {
+    jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+static void onJpegError(j_common_ptr cinfo) {
+    longjmp(((JpegError*)cinfo->err)->jump, 1);
+}
+
+bool kfb_decode_jpeg(const BYTE* src, int nBytes, BYTE* dest, ll rowStride, int maxWidth, int maxHeight, int* width, int* height) {
+    if(!src || nBytes <= 0) return false;
+    jpeg_decompress_struct cinfo;
+    JpegError err;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = onJpegError;
+    vector<BYTE> row;
+    if(setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (BYTE*)src, nBytes);
+    if(jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    if(width) *width = cinfo.image_width;
+    if(height) *height = cinfo.image_height;
+    if(!dest) {
+        jpeg_destroy_decompress(&cinfo);
+        return true;
+    }
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    int copyWidth = min<int>(maxWidth, cinfo.output_width);
+    row.resize((size_t)cinfo.output_width * 3);
+    while(cinfo.output_scanline < cinfo.output_height) {
+        int y = cinfo.output_scanline;
+        BYTE* target = y < maxHeight && copyWidth == (int)cinfo.output_width ? dest + y * rowStride : row.data();
+        jpeg_read_scanlines(&cinfo, &target, 1);
+        if(y < maxHeight && target == row.data()) memcpy(dest + y * rowStride, row.data(), (size_t)copyWidth * 3);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+bool kfb_decode_jpeg(const BYTE* src, int nBytes, vector<BYTE>& rgb, int* width, int* height) {
+    int w = 0, h = 0;
+    if(!kfb_decode_jpeg(src, nBytes, nullptr, 0, 0, 0, &w, &h)) return false;
+    rgb.resize((size_t)w * h * 3);
+    if(!kfb_decode_jpeg(src, nBytes, rgb.data(), (ll)w * 3, w, h, width, height)) return false;
+    return true;
+}
+
+bool kfb_encode_jpeg(const BYTE* rgb, int width, int height, int quality, vector<BYTE>& out) {
+    if(!rgb || width <= 0 || height <= 0) return false;
+    jpeg_compress_struct cinfo;
+    JpegError err;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = onJpegError;
+    unsigned char* mem = nullptr;
+    unsigned long memSize = 0;
+    if(setjmp(err.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        free(mem);
+        return false;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &mem, &memSize);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while(cinfo.next_scanline < cinfo.image_height) {
+        BYTE* row = (BYTE*)rgb + (ll)cinfo.next_scanline * width * 3;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    out.assign(mem, mem + memSize);
+    free(mem);
+    return true;
+}
+
+bool kfbslide_get_image_roi_rgb(ImgHandle* s, int level, int x, int y, int width, int height, BYTE* dest) {
+    if(!dest || width <= 0 || height <= 0) return false;
+    BYTE* buf = nullptr;
+    int nBytes = 0;
+    if(!kfbslide_get_image_roi_stream(s, level, x, y, width, height, &nBytes, &buf)) {
+        kfbslide_buffer_free(s, buf);
+        return false;
+    }
+    int w = 0, h = 0;
+    bool ret = kfb_decode_jpeg(buf, nBytes, dest, (ll)width * 3, width, height, &w, &h);
+    kfbslide_buffer_free(s, buf);
+    if(!ret) return false;
+    // zero the part of dest the decoded image did not cover
+    for(int row = 0; row < height; row++) {
+        BYTE* line = dest + (ll)row * width * 3;
+        if(row >= h) memset(line, 0, (size_t)width * 3);
+        else if(w < width) memset(line + (ll)w * 3, 0, (size_t)(width - w) * 3);
+    }
+    return true;
+}
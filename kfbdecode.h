@@ -0,0 +1,37 @@
+#ifndef __KFBDECODE__
+#define __KFBDECODE__
+#include "kfbreader.h"
+
+// JPEG 编解码 (libjpeg), 供读取 RGB 数据的接口和测试数据生成使用
+
+/**
+ * Decode a JPEG stream into an RGB buffer.
+ *
+ * @param dest Top left pixel of the destination, NULL to only read the header.
+ * @param rowStride Bytes between two rows of @p dest.
+ * @param maxWidth, maxHeight Pixels outside this rectangle are dropped.
+ * @param[out] width, height The size of the JPEG image.
+ * @return false if the stream is not a valid JPEG.
+ */
+bool kfb_decode_jpeg(const BYTE* src, int nBytes, BYTE* dest, ll rowStride, int maxWidth, int maxHeight, int* width, int* height);
+
+// Decode the whole image, rgb is resized to width * height * 3.
+bool kfb_decode_jpeg(const BYTE* src, int nBytes, vector<BYTE>& rgb, int* width, int* height);
+
+// Encode an RGB image, out receives the JPEG stream.
+bool kfb_encode_jpeg(const BYTE* rgb, int width, int height, int quality, vector<BYTE>& out);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/**
+ * Read a region like kfbslide_get_image_roi_stream() and decode it into @p dest.
+ *
+ * @param dest At least (@p width * @p height * 3) bytes, RGB, row major.
+ *             Pixels not covered by the decoded image are set to 0.
+ */
+bool kfbslide_get_image_roi_rgb(ImgHandle* s, int level, int x, int y, int width, int height, BYTE* dest);
+#ifdef __cplusplus
+}
+#endif
+#endif
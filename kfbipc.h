@@ -0,0 +1,178 @@
+#ifndef __KFBIPC__
+#define __KFBIPC__
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// kfbdaemon 与 kfbclient 之间的协议
+// 控制消息走 Unix socket, 图像数据通过客户端创建的共享内存环形缓冲区返回
+// 环是封住大小的 memfd (F_SEAL_SHRINK | F_SEAL_GROW), 随 HELLO 以 SCM_RIGHTS 传给 daemon
+
+#define KFBD_DEFAULT_SOCKET "/tmp/kfbdaemon.sock"
+#define KFBD_PATH_MAX 1024
+#define KFBD_RING_MAGIC 0x4B464252u   // "KFBR"
+#define KFBD_MAX_SLOTS 64
+#define KFBD_DEFAULT_SLOTS 16
+#define KFBD_DEFAULT_SLOT_SIZE (8 << 20)
+
+enum KfbdOp {
+    KFBD_OP_HELLO = 1,          // the ring memfd is attached to the request
+    KFBD_OP_OPEN,               // path: slide filename
+    KFBD_OP_ASSO_NAMES,
+    KFBD_OP_ASSO_DIMS,          // path: associated image name
+    KFBD_OP_ASSO_READ,          // path: associated image name
+    KFBD_OP_READ_REGION,
+    KFBD_OP_ROI_STREAM,
+    KFBD_OP_CLOSE
+};
+
+enum KfbdStatus {
+    KFBD_OK = 0,
+    KFBD_EFAIL,                 // the vendor call failed
+    KFBD_EPROTO,                // bad request or request out of order
+    KFBD_ENOSLOT,               // all ring slots are held by the client
+    KFBD_ETOOBIG,               // the image does not fit into one slot
+    KFBD_EACCESS                // the client's user may not read the slide
+};
+
+// Slot state is shared by both processes: the daemon claims a free slot,
+// the client hands it back in kfbclient_buffer_free() or kfbclient_close().
+enum KfbdSlotState : uint32_t {
+    KFBD_SLOT_FREE = 0,
+    KFBD_SLOT_BUSY = 1
+};
+
+struct KfbdRingHeader {
+    uint32_t magic;
+    uint32_t nSlots;
+    uint32_t slotSize;
+    uint32_t dataOffset;        // offset of slot 0 from the start of the mapping
+    std::atomic<uint32_t> state[KFBD_MAX_SLOTS];
+};
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "ring slots need lock-free atomics");
+
+struct KfbdRequest {
+    int32_t op;
+    int32_t level;
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+    char path[KFBD_PATH_MAX];
+};
+
+// payloadBytes of extra data follow the response on the socket:
+//  KFBD_OP_OPEN        "key\0value\0key\0value\0..."
+//  KFBD_OP_ASSO_NAMES  "name\0name\0..."
+struct KfbdResponse {
+    int32_t status;
+    int32_t slot;
+    int32_t nBytes;
+    int32_t width;
+    int32_t height;
+    int32_t maxLevel;
+    int32_t scanScale;
+    uint32_t payloadBytes;
+};
+
+static inline size_t kfbd_ring_bytes(uint32_t nSlots, uint32_t slotSize, uint32_t* dataOffset) {
+    uint32_t off = (sizeof(KfbdRingHeader) + 4095) & ~4095u;
+    if(dataOffset) *dataOffset = off;
+    return off + (size_t)nSlots * slotSize;
+}
+
+static inline bool kfbd_read_full(int fd, void* buf, size_t len) {
+    char* p = (char*)buf;
+    while(len > 0) {
+        ssize_t r = read(fd, p, len);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return false;
+        p += r;
+        len -= r;
+    }
+    return true;
+}
+
+static inline bool kfbd_write_full(int fd, const void* buf, size_t len) {
+    const char* p = (const char*)buf;
+    while(len > 0) {
+        ssize_t r = send(fd, p, len, MSG_NOSIGNAL);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return false;
+        p += r;
+        len -= r;
+    }
+    return true;
+}
+
+// Sends buf with fd attached to its first byte.
+static inline bool kfbd_send_fd(int sock, const void* buf, size_t len, int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    iovec iov = {(void*)buf, len};
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    ssize_t r;
+    do r = sendmsg(sock, &msg, MSG_NOSIGNAL); while(r < 0 && errno == EINTR);
+    if(r <= 0) return false;
+    return kfbd_write_full(sock, (const char*)buf + r, len - r);
+}
+
+// kfbd_read_full() that also receives a descriptor sent with the data,
+// *fd is -1 if none came; further descriptors are closed.
+static inline bool kfbd_read_full_fd(int sock, void* buf, size_t len, int* fd) {
+    char* p = (char*)buf;
+    *fd = -1;
+    while(len > 0) {
+        char control[CMSG_SPACE(sizeof(int) * 4)];
+        iovec iov = {p, len};
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if(r < 0 && errno == EINTR) continue;
+        for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); r > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for(size_t i = 0; i < n; i++) {
+                int passed;
+                memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if(*fd < 0) *fd = passed;
+                else close(passed);
+            }
+        }
+        if(r <= 0) {
+            if(*fd >= 0) close(*fd);
+            *fd = -1;
+            return false;
+        }
+        p += r;
+        len -= r;
+    }
+    return true;
+}
+
+static inline bool kfbd_socket_addr(const char* socketPath, sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(strlen(socketPath) >= sizeof(addr->sun_path)) return false;
+    strcpy(addr->sun_path, socketPath);
+    return true;
+}
+#endif
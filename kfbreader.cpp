@@ -2,13 +2,24 @@
 
 const char* names[] = {"openslide.mpp-x", "openslide.mpp-t", "openslide.vendor", "scanScale", nullptr};
 const char* assoNames[] = {"label", "macro", "thumbnail", nullptr};
+static atomic<uint32_t> traceIds(0);
+
+static void UnInitImageFile(ImgHandle* s) {
+    DLLUnInitImageFileFunc UnInitImageFileFunc = (DLLUnInitImageFileFunc)dlsym(s->handle, "UnInitImageFileFunc");
+    if(!UnInitImageFileFunc) {
+    	printf("%s\n", "Error: dlsym failed.");
+        exit(EXIT_FAILURE);        
+    }
+    UnInitImageFileFunc(s->imgStruct);
+}
 
 ImgHandle* kfbslide_open(const char * dllPath, const char* filename) {
+    KfbTraceScope trace(KFB_TRACE_OPEN, 0, 0, 0, 0, 0, 0, filename);
 	void *handle = NULL;
 	handle = dlopen(dllPath, RTLD_LAZY);
     if(!handle){
         fprintf(stderr, "%s\n", dlerror());
-        exit(EXIT_FAILURE);
+        return nullptr;
     }
     ImgHandle* s = new ImgHandle;
     s->handle = handle;
@@ -33,6 +44,7 @@ ImgHandle* kfbslide_open(const char * dllPath, const char* filename) {
                                             &(headerInfo.CapRes),
                                             &(headerInfo.BlockSize));
     if(!getHeaderInfoRtn) {
+        UnInitImageFile(s);
         delete s;
         return nullptr;
     }
@@ -45,17 +57,19 @@ ImgHandle* kfbslide_open(const char * dllPath, const char* filename) {
     
     s->height = headerInfo.Height;
     s->width = headerInfo.Width;
+    // 头信息中没有 block 大小时按 256 处理
+    s->blockSize = headerInfo.BlockSize > 0 ? headerInfo.BlockSize : 256;
     s->maxLevel = min(6, (int)(log(max(s->height, s->width)) / log(2)));
+    s->traceId = ++traceIds;
+    trace.slide(s->traceId);
+    trace.finish(true);
     return s;
 }
 
 void kfbslide_close(ImgHandle* s) {
-    DLLUnInitImageFileFunc UnInitImageFile = (DLLUnInitImageFileFunc)dlsym(s->handle, "UnInitImageFileFunc");
-    if(!UnInitImageFile) {
-    	printf("%s\n", "Error: dlsym failed.");
-        exit(EXIT_FAILURE);        
-    }
-    UnInitImageFile(s->imgStruct);
+    KfbTraceScope trace(KFB_TRACE_CLOSE, s->traceId);
+    trace.finish(true);
+    UnInitImageFile(s);
     delete s;
 }
 
@@ -114,12 +128,16 @@ ll kfbslide_get_level_dimensions(ImgHandle* s, int level, ll* width, ll* height)
 */
 //! 希望对读出数据的任何改变都不会影响下一次读取, 因此必须拷贝
 BYTE* kfbslide_read_associated_image(ImgHandle* s, const char* name) {
+    KfbTraceScope trace(KFB_TRACE_ASSO_READ, s->traceId, 0, 0, 0, 0, 0, name);
     string n(name);
+    lock_guard<mutex> assoGuard(s->asso_lock);
     auto iter = s->assoImages.find(n);
     if(iter != s->assoImages.end()) {
         BYTE* buf = new BYTE[iter->second.nBytes];
         memcpy(buf, iter->second.buf.get(), iter->second.nBytes);
+        lock_guard<mutex> guard(s->alloc_lock);
         s->alloc_mem.push_back(buf);
+        trace.finish(true, iter->second.nBytes, buf);
         return buf;
     }
     return nullptr;
@@ -132,6 +150,7 @@ void kfbslide_get_associated_image_dimensions(ImgHandle* s, const char* name, ll
     }
     
     string n(name);
+    lock_guard<mutex> guard(s->asso_lock);
     auto iter = s->assoImages.find(n);
     if(iter != s->assoImages.end()) {
         *width = iter->second.width;
@@ -145,7 +164,10 @@ void kfbslide_get_associated_image_dimensions(ImgHandle* s, const char* name, ll
 }
 
 const char** kfbslide_get_associated_image_names(ImgHandle* s) {
+    lock_guard<mutex> guard(s->asso_lock);
     if(s->assoNames) return s->assoNames;
+    KfbTraceScope trace(KFB_TRACE_ASSO_NAMES, s->traceId);
+    trace.finish(true);
     s->assoNames = new const char*[4]{nullptr};
 
     // Try to call getThumb, getPreview, getLabel
@@ -163,6 +185,7 @@ const char** kfbslide_get_associated_image_names(ImgHandle* s) {
     // bytesize width height
     int ret[3] = {0, 0, 0};
     int cnt = 0;
+    lock_guard<mutex> vendorGuard(s->vendor_lock);
     if(GetLabelImageFunc(s->imgStruct, &buf, ret, ret + 1, ret + 2)) {
         s->assoImages["label"] = AssoImage{ret[0], ret[1], ret[2], shared_ptr<BYTE>(buf, default_delete<BYTE []>())};
         s->assoNames[cnt++] = "label";
@@ -185,6 +208,7 @@ const char** kfbslide_get_associated_image_names(ImgHandle* s) {
     Load Data
 */
 bool kfbslide_read_region(ImgHandle* s, int level, int x, int y, int* nBytes, BYTE** buf) {
+    KfbTraceScope trace(KFB_TRACE_READ_REGION, s->traceId, level, x, y);
     if(level < 0 || level >= s->maxLevel) return false;
     if(!buf  || !nBytes) {
         printf("You must pass nBytes and buf ptr ByRef!");
@@ -197,12 +221,18 @@ bool kfbslide_read_region(ImgHandle* s, int level, int x, int y, int* nBytes, BY
         exit(EXIT_FAILURE);
 	}    
     float fScale = s->scanScale / kfbslide_get_level_downsample(s, level);
-    void* ptr = GetImageStreamFunc(s->imgStruct, fScale, x, y, nBytes, buf);
+    {
+        lock_guard<mutex> vendorGuard(s->vendor_lock);
+        GetImageStreamFunc(s->imgStruct, fScale, x, y, nBytes, buf);
+    }
+    lock_guard<mutex> guard(s->alloc_lock);
     s->alloc_mem.push_back(*buf);
+    trace.finish(*nBytes > 0, *nBytes, *buf);
     return *nBytes > 0;
 }
 
 bool kfbslide_get_image_roi_stream(ImgHandle* s, int level, int x, int y, int width, int height, int* nBytes, BYTE** buf) {
+    KfbTraceScope trace(KFB_TRACE_ROI_STREAM, s->traceId, level, x, y, width, height);
     if(level < 0 || level >= s->maxLevel) return false;
     if(!buf || !nBytes) {
         printf("You must pass nBytes and buf ptr ByRef!");
@@ -220,8 +250,14 @@ bool kfbslide_get_image_roi_stream(ImgHandle* s, int level, int x, int y, int wi
     x = x / downsample_factor;
     y = y / downsample_factor;
     
-    bool ret = GetImageDataRoi(s->imgStruct, fScale, x, y, width, height, buf, nBytes, true);
+    bool ret;
+    {
+        lock_guard<mutex> vendorGuard(s->vendor_lock);
+        ret = GetImageDataRoi(s->imgStruct, fScale, x, y, width, height, buf, nBytes, true);
+    }
+    lock_guard<mutex> guard(s->alloc_lock);
     s->alloc_mem.push_back(*buf);
+    trace.finish(ret, *nBytes, *buf);
     return ret;
 }
 
@@ -230,8 +266,12 @@ bool kfbslide_get_image_roi_stream(ImgHandle* s, int level, int x, int y, int wi
 */
 bool kfbslide_buffer_free(ImgHandle* s, BYTE* buf) {
     if(!buf) return false;
+    KfbTraceScope trace(KFB_TRACE_BUFFER_FREE, s->traceId);
+    trace.finish(false, 0, buf);
+    lock_guard<mutex> guard(s->alloc_lock);
     for(auto iter=s->alloc_mem.begin(); iter != s->alloc_mem.end(); iter++) {
         if(*iter == buf) {
+            trace.finish(true, 0, buf);
             delete [] buf;
             s->alloc_mem.erase(iter);
             return true;
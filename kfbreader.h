@@ -6,7 +6,9 @@
 #include <cmath>
 #include <vector>
 #include <memory>
+#include <mutex>
 #include "KFB.h"
+#include "kfbtrace.h"
 
 
 using ll=long long int;
@@ -34,6 +36,25 @@ struct AssoImage {
     ~AssoImage()=default;
 };
 
+// 每张切片的染色统计量, 由缩略图估计一次后缓存在 ImgHandle 中
+struct StainStats {
+    bool estimated;
+    bool reinhardValid;     // each method has its own tissue requirements, one may fail alone
+    bool macenkoValid;
+    float labMean[3];       // Reinhard: mean and std of the tissue pixels in l-alpha-beta space
+    float labStd[3];
+    float stainMatrix[3][2]; // Macenko: H and E optical density vectors as columns
+    float maxConc[2];       // Macenko: 99th percentile of the H and E concentrations
+
+    StainStats() {
+        estimated = reinhardValid = macenkoValid = false;
+        memset(labMean, 0, sizeof(labMean));
+        memset(labStd, 0, sizeof(labStd));
+        memset(stainMatrix, 0, sizeof(stainMatrix));
+        memset(maxConc, 0, sizeof(maxConc));
+    }
+};
+
 struct ImgHandle {
     void* handle;
     ImageInfoStruct* imgStruct;
@@ -42,9 +63,16 @@ struct ImgHandle {
     int scanScale;
     int width;
     int height;
+    int blockSize;          // side of the blocks GetImageStreamFunc returns, HeaderInfoStruct.BlockSize
     const char** assoNames;
     map<string, AssoImage> assoImages;
     vector<BYTE*> alloc_mem;
+    mutex alloc_lock;       // reads may run on several threads, alloc_mem is shared
+    mutex vendor_lock;      // libImageOperationLib.so is not known to be thread-safe, one call per handle at a time
+    mutex asso_lock;        // assoNames and assoImages are filled on first use
+    StainStats stain;
+    mutex stain_lock;       // held while kfbslide_estimate_stain fills stain
+    uint32_t traceId;           // identifies the slide in kfbtrace records
     bool debug;
 
     ImgHandle() {
@@ -56,7 +84,9 @@ struct ImgHandle {
         maxLevel = 0;
         scanScale = 0;
         width = height = 0;
+        blockSize = 0;
         assoNames = nullptr;
+        traceId = 0;
         debug = false;
     }
 
@@ -81,10 +111,12 @@ extern "C" {
  * request.  Instead, it should maintain a cache of OpenSlide objects and
  * reuse them when possible.
  *
+ * @param dllPath Path of libImageOperationLib.so.
  * @param filename The filename to open.  On Windows, this must be in UTF-8.
  * @return
  *         On success, a new OpenSlide object.
  *         If the file is not recognized by OpenSlide, NULL.
+ *         If @p dllPath cannot be loaded, NULL.
  *         If the file is recognized but an error occurred, an OpenSlide
  *         object in error state.
  */
@@ -0,0 +1,256 @@
+#include <algorithm>
+#include <condition_variable>
+#include <set>
+#include <thread>
+#include "kfbreader.h"
+
+// 回放 kfbtrace 记录: 每个原始线程对应一个回放线程, 按原速度或加速重放, 输出延迟分位数与吞吐
+// Usage: kfbreplay <trace> <libImageOperationLib.so or libkfbstub.so> [--speed X] [--slide PATH]
+//   --speed 0 replays as fast as possible, 2 twice as fast as recorded (default 1)
+//   --slide opens PATH instead of the recorded filenames
+
+struct Event {
+    KfbTraceRecord rec;
+    string name;
+    const Event* producer;      // the read that returned the buffer of a buffer_free, NULL if not in the trace
+};
+
+struct OpStats {
+    vector<double> latency;     // us
+    ll bytes;
+    ll failed;
+
+    OpStats() {
+        bytes = failed = 0;
+    }
+};
+
+static const char* opNames[KFB_TRACE_OP_COUNT] = {
+    "", "open", "close", "read_region", "roi_stream", "asso_names", "asso_read", "buffer_free"
+};
+
+static const char* dllPath = nullptr;
+static const char* slidePath = nullptr;
+static double speed = 1.0;
+static chrono::steady_clock::time_point replayStart;
+
+static mutex stateLock;
+static condition_variable slideOpened, bufferReady;
+static map<uint32_t, ImgHandle*> slides;                    // trace slide id -> replayed handle, NULL if the open failed
+static map<const Event*, pair<ImgHandle*, BYTE*>> buffers;  // replayed read -> its buffer, NULL if it returned none
+static atomic<ll> skippedFrees(0);
+
+static bool loadTrace(const char* path, vector<Event>& events) {
+    FILE* fp = fopen(path, "rb");
+    if(!fp) return false;
+    KfbTraceFileHeader header;
+    if(fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, KFB_TRACE_MAGIC, sizeof(header.magic))
+       || header.version != KFB_TRACE_VERSION) {
+        fclose(fp);
+        return false;
+    }
+    Event e;
+    e.producer = nullptr;
+    while(fread(&e.rec, sizeof(e.rec), 1, fp) == 1) {
+        e.name.assign(e.rec.nameLength, '\0');
+        if(e.rec.nameLength && fread(&e.name[0], 1, e.rec.nameLength, fp) != e.rec.nameLength) break;
+        if(e.rec.op > 0 && e.rec.op < KFB_TRACE_OP_COUNT) events.push_back(e);
+    }
+    fclose(fp);
+    // records are flushed per thread, restore the call order
+    stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) { return a.rec.start < b.rec.start; });
+    return true;
+}
+
+static ImgHandle* waitSlide(uint32_t id) {
+    unique_lock<mutex> guard(stateLock);
+    slideOpened.wait(guard, [&]() { return slides.count(id) > 0; });
+    return slides[id];
+}
+
+static bool producesBuffer(int op) {
+    return op == KFB_TRACE_READ_REGION || op == KFB_TRACE_ROI_STREAM || op == KFB_TRACE_ASSO_READ;
+}
+
+// 缓冲区可能由另一个线程的读取产生, 等它回放完成后再释放
+static pair<ImgHandle*, BYTE*> waitBuffer(const Event* producer) {
+    unique_lock<mutex> guard(stateLock);
+    bufferReady.wait(guard, [&]() { return buffers.count(producer) > 0; });
+    auto iter = buffers.find(producer);
+    pair<ImgHandle*, BYTE*> buf = iter->second;
+    buffers.erase(iter);
+    return buf;
+}
+
+static void readDone(const Event* e, ImgHandle* s, BYTE* buf) {
+    lock_guard<mutex> guard(stateLock);
+    buffers[e] = make_pair(s, buf);
+    bufferReady.notify_all();
+}
+
+static void replay(const vector<const Event*>& events, vector<OpStats>& stats) {
+    for(const Event* e : events) {
+        const KfbTraceRecord& r = e->rec;
+        if(speed > 0)
+            this_thread::sleep_until(replayStart + chrono::nanoseconds((ll)(r.start / speed)));
+        ImgHandle* s = nullptr;
+        if(r.op != KFB_TRACE_OPEN && !(s = waitSlide(r.slide))) {
+            if(producesBuffer(r.op)) readDone(e, nullptr, nullptr);
+            continue;
+        }
+        // close 推迟到所有线程结束: --speed 0 时其他线程的读取可能还没回放到
+        if(r.op == KFB_TRACE_CLOSE) continue;
+
+        BYTE* buf = nullptr;
+        int nBytes = 0;
+        bool ok = true;
+        pair<ImgHandle*, BYTE*> freed(nullptr, nullptr);
+        if(r.op == KFB_TRACE_BUFFER_FREE) {
+            if(e->producer) freed = waitBuffer(e->producer);
+            if(!freed.second) {
+                skippedFrees++;
+                continue;
+            }
+        }
+        ll assoBytes = 0;
+        if(r.op == KFB_TRACE_ASSO_READ) {
+            ll w, h;
+            kfbslide_get_associated_image_dimensions(s, e->name.c_str(), &w, &h, &assoBytes);
+        }
+
+        auto start = chrono::steady_clock::now();
+        switch(r.op) {
+        case KFB_TRACE_OPEN:
+            s = kfbslide_open(dllPath, slidePath ? slidePath : e->name.c_str());
+            ok = s != nullptr;
+            break;
+        case KFB_TRACE_READ_REGION:
+            ok = kfbslide_read_region(s, r.level, r.x, r.y, &nBytes, &buf);
+            break;
+        case KFB_TRACE_ROI_STREAM:
+            ok = kfbslide_get_image_roi_stream(s, r.level, r.x, r.y, r.width, r.height, &nBytes, &buf);
+            break;
+        case KFB_TRACE_ASSO_NAMES:
+            kfbslide_get_associated_image_names(s);
+            break;
+        case KFB_TRACE_ASSO_READ:
+            buf = kfbslide_read_associated_image(s, e->name.c_str());
+            ok = buf != nullptr;
+            nBytes = assoBytes;
+            break;
+        case KFB_TRACE_BUFFER_FREE:
+            ok = kfbslide_buffer_free(freed.first, freed.second);
+            break;
+        }
+        double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+
+        OpStats& st = stats[r.op];
+        st.latency.push_back(us);
+        if(ok) st.bytes += nBytes;
+        else st.failed++;
+        // 未释放的缓冲区保留到 close, 与原进程的内存占用一致
+        if(producesBuffer(r.op)) readDone(e, s, buf);
+        if(r.op == KFB_TRACE_OPEN) {
+            lock_guard<mutex> guard(stateLock);
+            slides[r.slide] = s;
+            slideOpened.notify_all();
+        }
+    }
+}
+
+static double percentile(const vector<double>& sorted, double p) {
+    if(sorted.empty()) return 0.0;
+    return sorted[min(sorted.size() - 1, (size_t)(p / 100 * (sorted.size() - 1) + 0.5))];
+}
+
+int main(int argc, char** argv) {
+    if(argc < 3) {
+        printf("Usage: %s <trace> <libImageOperationLib.so> [--speed X] [--slide PATH]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    dllPath = argv[2];
+    for(int i = 3; i + 1 < argc; i += 2) {
+        if(!strcmp(argv[i], "--speed")) speed = atof(argv[i + 1]);
+        else if(!strcmp(argv[i], "--slide")) slidePath = argv[i + 1];
+    }
+    vector<Event> events;
+    if(!loadTrace(argv[1], events)) {
+        printf("Error: cannot read trace %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    // pair every buffer_free with the read that returned its buffer, addresses are reused after a free
+    map<uint64_t, const Event*> live;
+    for(Event& e : events) {
+        if(!e.rec.buffer) continue;
+        if(producesBuffer(e.rec.op)) live[e.rec.buffer] = &e;
+        else if(e.rec.op == KFB_TRACE_BUFFER_FREE) {
+            auto iter = live.find(e.rec.buffer);
+            if(iter == live.end()) continue;
+            e.producer = iter->second;
+            live.erase(iter);
+        }
+    }
+
+    // slides opened before the trace started can only be replayed with --slide
+    set<uint32_t> opened;
+    for(const Event& e : events)
+        if(e.rec.op == KFB_TRACE_OPEN && e.rec.ok) opened.insert(e.rec.slide);
+    map<uint32_t, vector<const Event*>> threads;
+    ll skipped = 0;
+    for(const Event& e : events) {
+        if(e.rec.op == KFB_TRACE_OPEN && !e.rec.ok) continue;
+        if(e.rec.op != KFB_TRACE_OPEN && !opened.count(e.rec.slide)) {
+            if(!slidePath) {
+                skipped++;
+                continue;
+            }
+            if(!slides.count(e.rec.slide)) slides[e.rec.slide] = kfbslide_open(dllPath, slidePath);
+        }
+        threads[e.rec.thread].push_back(&e);
+    }
+
+    vector<vector<OpStats>> stats(threads.size(), vector<OpStats>(KFB_TRACE_OP_COUNT));
+    vector<thread> workers;
+    replayStart = chrono::steady_clock::now();
+    size_t t = 0;
+    for(auto& kv : threads) {
+        workers.emplace_back(replay, cref(kv.second), ref(stats[t]));
+        t++;
+    }
+    for(thread& w : workers) w.join();
+
+    // deferred closes, and slides the trace never closed
+    vector<OpStats> total(KFB_TRACE_OP_COUNT);
+    for(auto& kv : slides) {
+        if(!kv.second) continue;
+        auto start = chrono::steady_clock::now();
+        kfbslide_close(kv.second);
+        total[KFB_TRACE_CLOSE].latency.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+    }
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - replayStart).count();
+
+    ll calls = 0, bytes = 0;
+    printf("%-12s %8s %8s %10s %10s %10s %10s %10s\n", "op", "count", "failed", "p50(us)", "p90(us)", "p99(us)", "max(us)", "MB");
+    for(int op = 1; op < KFB_TRACE_OP_COUNT; op++) {
+        OpStats& st = total[op];
+        for(auto& s : stats) {
+            st.latency.insert(st.latency.end(), s[op].latency.begin(), s[op].latency.end());
+            st.bytes += s[op].bytes;
+            st.failed += s[op].failed;
+        }
+        if(st.latency.empty()) continue;
+        sort(st.latency.begin(), st.latency.end());
+        printf("%-12s %8zu %8lld %10.1f %10.1f %10.1f %10.1f %10.2f\n", opNames[op], st.latency.size(), st.failed,
+               percentile(st.latency, 50), percentile(st.latency, 90), percentile(st.latency, 99), st.latency.back(),
+               st.bytes / 1048576.0);
+        calls += st.latency.size();
+        bytes += st.bytes;
+    }
+    double span = events.empty() ? 0.0 : events.back().rec.start / 1e9;
+    printf("replayed %lld calls on %zu threads in %.3f s (recorded span %.3f s, speed %g): %.1f calls/s, %.2f MB/s\n",
+           calls, threads.size(), wall, span, speed, calls / wall, bytes / 1048576.0 / wall);
+    if(skipped) printf("skipped %lld calls on slides opened before the trace started, pass --slide to replay them\n", skipped);
+    if(skippedFrees) printf("skipped %lld buffer_free calls whose buffer was not returned by a replayed read\n", (ll)skippedFrees);
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include <atomic>
+#include <thread>
+#include "kfbroi.h"
+#include "kfbdecode.h"
+
+struct RoiBlock {
+    int bx;
+    int by;
+    vector<int> rois;   // regions overlapping this block
+};
+
+static bool readBlock(ImgHandle* s, int level, int bx, int by, vector<BYTE>& rgb, int* width, int* height) {
+    int x = bx * s->blockSize, y = by * s->blockSize;
+    BYTE* buf = nullptr;
+    int nBytes = 0;
+    bool ret = kfbslide_read_region(s, level, x, y, &nBytes, &buf)
+            && kfb_decode_jpeg(buf, nBytes, rgb, width, height);
+    kfbslide_buffer_free(s, buf);
+    return ret;
+}
+
+bool kfbslide_read_rois(ImgHandle* s, int level, const KfbRoi* rois, int nRois, BYTE** dests, int nThreads, KfbRoiStats* stats) {
+    ll levelWidth = 0, levelHeight = 0;
+    if(!rois || !dests || nRois <= 0 || !kfbslide_get_level_dimensions(s, level, &levelWidth, &levelHeight)) return false;
+    double downsample = kfbslide_get_level_downsample(s, level);
+    const int blockSize = s->blockSize;
+
+    // level coordinates of every region, and the union of their blocks
+    vector<ll> xs(nRois), ys(nRois);
+    map<pair<int, int>, int> index;
+    vector<RoiBlock> blocks;
+    ll outputBytes = 0;
+    for(int i = 0; i < nRois; i++) {
+        const KfbRoi& r = rois[i];
+        if(!dests[i] || r.width <= 0 || r.height <= 0) return false;
+        memset(dests[i], 0, (size_t)r.width * r.height * 3);
+        outputBytes += (ll)r.width * r.height * 3;
+        xs[i] = (ll)(r.x / downsample);
+        ys[i] = (ll)(r.y / downsample);
+        ll x0 = max(0LL, xs[i]), y0 = max(0LL, ys[i]);
+        ll x1 = min(levelWidth, xs[i] + r.width), y1 = min(levelHeight, ys[i] + r.height);
+        if(x0 >= x1 || y0 >= y1) continue;
+        for(int by = y0 / blockSize; by <= (y1 - 1) / blockSize; by++)
+            for(int bx = x0 / blockSize; bx <= (x1 - 1) / blockSize; bx++) {
+                auto iter = index.find({bx, by});
+                if(iter == index.end()) {
+                    iter = index.insert({{bx, by}, (int)blocks.size()}).first;
+                    blocks.push_back(RoiBlock{bx, by, {}});
+                }
+                blocks[iter->second].rois.push_back(i);
+            }
+    }
+
+    // 每个 block 解码后立即裁剪到所有相关 ROI, 不同 block 写入的区域互不重叠
+    atomic<int> next(0);
+    atomic<ll> decodedBytes(0), naiveDecodedBytes(0);
+    atomic<bool> ok(true);
+    auto worker = [&]() {
+        vector<BYTE> rgb;
+        for(int b = next++; b < (int)blocks.size(); b = next++) {
+            const RoiBlock& block = blocks[b];
+            int w = 0, h = 0;
+            if(!readBlock(s, level, block.bx, block.by, rgb, &w, &h)) {
+                ok = false;
+                continue;
+            }
+            decodedBytes += (ll)w * h * 3;
+            naiveDecodedBytes += (ll)w * h * 3 * block.rois.size();
+            ll bx0 = (ll)block.bx * blockSize, by0 = (ll)block.by * blockSize;
+            for(int i : block.rois) {
+                const KfbRoi& r = rois[i];
+                ll x0 = max(bx0, xs[i]), x1 = min(bx0 + w, xs[i] + r.width);
+                ll y0 = max(by0, ys[i]), y1 = min(by0 + h, ys[i] + r.height);
+                for(ll y = y0; y < y1; y++)
+                    memcpy(dests[i] + ((y - ys[i]) * r.width + (x0 - xs[i])) * 3,
+                           rgb.data() + ((y - by0) * w + (x0 - bx0)) * 3,
+                           (size_t)max(0LL, x1 - x0) * 3);
+            }
+        }
+    };
+    if(nThreads <= 0) nThreads = max(1u, thread::hardware_concurrency());
+    nThreads = max(1, min(nThreads, (int)blocks.size()));
+    vector<thread> threads;
+    for(int t = 1; t < nThreads; t++) threads.emplace_back(worker);
+    worker();
+    for(thread& t : threads) t.join();
+
+    if(stats) {
+        stats->blocks = blocks.size();
+        stats->decodedBytes = decodedBytes;
+        stats->outputBytes = outputBytes;
+        stats->naiveDecodedBytes = naiveDecodedBytes;
+        stats->amplification = double(stats->decodedBytes) / outputBytes;
+        stats->naiveAmplification = double(stats->naiveDecodedBytes) / outputBytes;
+    }
+    return ok;
+}
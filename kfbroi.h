@@ -0,0 +1,42 @@
+#ifndef __KFBROI__
+#define __KFBROI__
+#include "kfbreader.h"
+
+// 多 ROI 读取: 重叠的窗口 (例如 512 窗口, 256 步长) 共享同一批 block,
+// 每个 block 只读取和解码一次, 再裁剪到各个 ROI 的输出缓冲区
+// block 大小取自切片头信息 (ImgHandle::blockSize)
+
+struct KfbRoi {
+    int x;          // top left, in the level 0 reference frame as in kfbslide_get_image_roi_stream()
+    int y;
+    int width;      // size at the requested level
+    int height;
+};
+
+struct KfbRoiStats {
+    ll blocks;              // distinct blocks read and decoded
+    ll decodedBytes;        // RGB bytes decoded
+    ll outputBytes;         // RGB bytes written to the ROI buffers
+    ll naiveDecodedBytes;   // RGB bytes decoded if every ROI read its blocks by itself
+    double amplification;   // decodedBytes / outputBytes
+    double naiveAmplification;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/**
+ * Read several regions of one level, decoding every covering block once.
+ *
+ * @param rois The regions, they may overlap.
+ * @param dests One RGB buffer per region, at least (width * height * 3) bytes.
+ *              Pixels outside the level are set to 0.
+ * @param nThreads Number of decoding threads, 0 for the number of CPUs.
+ * @param stats Optional, receives the decoded byte amplification.
+ * @return false if any block failed to read, the pixels of that block stay 0.
+ */
+bool kfbslide_read_rois(ImgHandle* s, int level, const KfbRoi* rois, int nRois, BYTE** dests, int nThreads, KfbRoiStats* stats);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,207 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "kfbsampler.h"
+#include "kfbdecode.h"
+
+// splitmix64: 结果只依赖种子, 不受标准库实现影响
+static uint64_t nextRandom(uint64_t& state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// uniform integer in [0, n)
+static ll randomBelow(uint64_t& state, ll n) {
+    if(n <= 0) return 0;
+    return (ll)((nextRandom(state) >> 11) * (1.0 / 9007199254740992.0) * n);
+}
+
+static double randomUnit(uint64_t& state) {
+    return (nextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static ll clampCoord(ll v, ll size, int patchSize) {
+    return max(0LL, min(v, size - patchSize));
+}
+
+// 缩略图中非白色且有一定饱和度的像素视为组织
+static bool loadTissue(PatchSampler* sampler) {
+    ImgHandle* s = sampler->s;
+    kfbslide_get_associated_image_names(s);
+    AssoImage thumbnail;
+    {
+        lock_guard<mutex> guard(s->asso_lock);
+        auto iter = s->assoImages.find("thumbnail");
+        if(iter == s->assoImages.end()) return false;
+        thumbnail = iter->second;
+    }
+    vector<BYTE> rgb;
+    int width = 0, height = 0;
+    if(!kfb_decode_jpeg(thumbnail.buf.get(), thumbnail.nBytes, rgb, &width, &height) || !width || !height)
+        return false;
+    for(int i = 0; i < width * height; i++) {
+        const BYTE* p = &rgb[(size_t)i * 3];
+        int mx = max(p[0], max(p[1], p[2])), mn = min(p[0], min(p[1], p[2]));
+        if(mx - mn >= 20 && p[0] + p[1] + p[2] < 3 * 220) sampler->tissue.push_back(i);
+    }
+    sampler->thumbWidth = width;
+    sampler->thumbScaleX = double(sampler->levelWidth) / width;
+    sampler->thumbScaleY = double(sampler->levelHeight) / height;
+    return !sampler->tissue.empty();
+}
+
+static void workerLoop(PatchSampler* sampler);
+
+PatchSampler* kfbsampler_create(ImgHandle* s, int level, int patchSize, int policy, uint64_t seed, int nThreads) {
+    ll width = 0, height = 0;
+    if(!s || patchSize <= 0 || !kfbslide_get_level_dimensions(s, level, &width, &height)) return nullptr;
+    if(width < patchSize || height < patchSize) return nullptr;
+    PatchSampler* sampler = new PatchSampler;
+    sampler->s = s;
+    sampler->level = level;
+    sampler->patchSize = patchSize;
+    sampler->policy = policy;
+    sampler->nThreads = nThreads > 0 ? nThreads : max(1u, thread::hardware_concurrency());
+    sampler->levelWidth = width;
+    sampler->levelHeight = height;
+    if(policy == KFB_SAMPLE_TISSUE && !loadTissue(sampler)) {
+        printf("%s\n", "Warning: no tissue found in thumbnail, sampling uniformly.");
+        sampler->policy = KFB_SAMPLE_UNIFORM;
+    }
+    if(policy == KFB_SAMPLE_GRID_JITTER) {
+        sampler->gridCols = width / patchSize;
+        sampler->gridOrder.resize(sampler->gridCols * (height / patchSize));
+    }
+    kfbsampler_reset(sampler, seed);
+    for(int t = 1; t < sampler->nThreads; t++) sampler->workers.emplace_back(workerLoop, sampler);
+    return sampler;
+}
+
+void kfbsampler_reset(PatchSampler* sampler, uint64_t seed) {
+    sampler->rng = seed;
+    sampler->gridPos = sampler->gridOrder.size();
+}
+
+// top left corner of the next patch, in level coordinates
+static void nextPatch(PatchSampler* sampler, ll* x, ll* y) {
+    int patch = sampler->patchSize;
+    uint64_t& rng = sampler->rng;
+    if(sampler->policy == KFB_SAMPLE_TISSUE) {
+        int idx = sampler->tissue[randomBelow(rng, sampler->tissue.size())];
+        double cx = (idx % sampler->thumbWidth + randomUnit(rng)) * sampler->thumbScaleX;
+        double cy = (idx / sampler->thumbWidth + randomUnit(rng)) * sampler->thumbScaleY;
+        *x = clampCoord((ll)cx - patch / 2, sampler->levelWidth, patch);
+        *y = clampCoord((ll)cy - patch / 2, sampler->levelHeight, patch);
+    } else if(sampler->policy == KFB_SAMPLE_GRID_JITTER) {
+        vector<ll>& order = sampler->gridOrder;
+        if(sampler->gridPos >= order.size()) {
+            // every pass starts from the same order so that the result only depends on the seed
+            for(size_t i = 0; i < order.size(); i++) order[i] = i;
+            for(size_t i = order.size(); i > 1; i--) swap(order[i - 1], order[randomBelow(rng, i)]);
+            sampler->gridPos = 0;
+        }
+        ll cell = order[sampler->gridPos++];
+        *x = clampCoord(cell % sampler->gridCols * patch + randomBelow(rng, patch + 1) - patch / 2, sampler->levelWidth, patch);
+        *y = clampCoord(cell / sampler->gridCols * patch + randomBelow(rng, patch + 1) - patch / 2, sampler->levelHeight, patch);
+    } else {
+        *x = randomBelow(rng, sampler->levelWidth - patch + 1);
+        *y = randomBelow(rng, sampler->levelHeight - patch + 1);
+    }
+}
+
+// 读取并解码当前 batch 中尚未被领取的 patch
+static void readPatches(PatchSampler* sampler, vector<BYTE>& tile) {
+    int patch = sampler->patchSize;
+    size_t planeBytes = (size_t)patch * patch, patchBytes = planeBytes * 3;
+    bool chw = sampler->layout == KFB_LAYOUT_CHW;
+    tile.resize(chw ? patchBytes : 0);
+    for(int i = sampler->next++; i < sampler->batchSize; i = sampler->next++) {
+        BYTE* out = sampler->dest + i * patchBytes;
+        BYTE* target = chw ? tile.data() : out;
+        if(!kfbslide_get_image_roi_rgb(sampler->s, sampler->level, sampler->xs[i], sampler->ys[i], patch, patch, target)) {
+            memset(out, 0, patchBytes);
+            sampler->ok = false;
+            continue;
+        }
+        if(chw) {
+            for(size_t p = 0; p < planeBytes; p++) {
+                out[p] = tile[3 * p];
+                out[planeBytes + p] = tile[3 * p + 1];
+                out[2 * planeBytes + p] = tile[3 * p + 2];
+            }
+        }
+    }
+}
+
+static void workerLoop(PatchSampler* sampler) {
+    vector<BYTE> tile;
+    uint64_t done = 0;
+    while(true) {
+        {
+            unique_lock<mutex> guard(sampler->jobLock);
+            sampler->jobReady.wait(guard, [&]() { return sampler->stopping || sampler->job != done; });
+            if(sampler->stopping) return;
+            done = sampler->job;
+        }
+        readPatches(sampler, tile);
+        lock_guard<mutex> guard(sampler->jobLock);
+        if(--sampler->running == 0) sampler->jobDone.notify_all();
+    }
+}
+
+bool kfbsampler_next_batch(PatchSampler* sampler, int batchSize, int layout, BYTE* dest, int* coords) {
+    if(!sampler || !dest || batchSize <= 0) return false;
+    auto start = chrono::steady_clock::now();
+    ll downsample = (ll)kfbslide_get_level_downsample(sampler->s, sampler->level);
+    // 坐标在读取之前按顺序生成, 线程调度不影响结果
+    sampler->xs.resize(batchSize);
+    sampler->ys.resize(batchSize);
+    for(int i = 0; i < batchSize; i++) {
+        nextPatch(sampler, &sampler->xs[i], &sampler->ys[i]);
+        sampler->xs[i] *= downsample;
+        sampler->ys[i] *= downsample;
+        if(coords) {
+            coords[2 * i] = sampler->xs[i];
+            coords[2 * i + 1] = sampler->ys[i];
+        }
+    }
+
+    sampler->batchSize = batchSize;
+    sampler->layout = layout;
+    sampler->dest = dest;
+    sampler->next = 0;
+    sampler->ok = true;
+    {
+        lock_guard<mutex> guard(sampler->jobLock);
+        sampler->job++;
+        sampler->running = sampler->workers.size();
+    }
+    sampler->jobReady.notify_all();
+    readPatches(sampler, sampler->tile);
+    {
+        unique_lock<mutex> guard(sampler->jobLock);
+        sampler->jobDone.wait(guard, [&]() { return sampler->running == 0; });
+    }
+
+    sampler->patches += batchSize;
+    sampler->seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return sampler->ok;
+}
+
+double kfbsampler_patches_per_second(PatchSampler* sampler) {
+    if(!sampler || sampler->seconds <= 0) return 0.0;
+    return sampler->patches / sampler->seconds;
+}
+
+void kfbsampler_destroy(PatchSampler* sampler) {
+    if(!sampler) return;
+    {
+        lock_guard<mutex> guard(sampler->jobLock);
+        sampler->stopping = true;
+    }
+    sampler->jobReady.notify_all();
+    for(thread& t : sampler->workers) t.join();
+    delete sampler;
+}
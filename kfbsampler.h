@@ -0,0 +1,120 @@
+#ifndef __KFBSAMPLER__
+#define __KFBSAMPLER__
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include "kfbreader.h"
+
+// 训练用的 patch 采样器: 按策略生成坐标, 多线程读取解码, 直接写入调用者的 batch 缓冲区
+// 坐标只由种子决定, 相同种子得到相同的 batch 序列
+// 同一切片上的厂商库调用由 kfbslide_* 串行化, 解码和 CHW 转置在各线程中并行
+
+enum KfbSamplePolicy {
+    KFB_SAMPLE_UNIFORM = 0,     // uniform over the whole level
+    KFB_SAMPLE_TISSUE,          // uniform over tissue pixels of the thumbnail
+    KFB_SAMPLE_GRID_JITTER      // shuffled grid of patch cells, each shifted by up to half a patch
+};
+
+enum KfbBatchLayout {
+    KFB_LAYOUT_HWC = 0,         // N x H x W x 3
+    KFB_LAYOUT_CHW              // N x 3 x H x W
+};
+
+struct PatchSampler {
+    ImgHandle* s;
+    int level;
+    int patchSize;
+    int policy;
+    int nThreads;
+    ll levelWidth;
+    ll levelHeight;
+    uint64_t rng;
+    // KFB_SAMPLE_TISSUE: tissue pixels of the thumbnail, and level pixels per thumbnail pixel
+    vector<int> tissue;
+    int thumbWidth;
+    double thumbScaleX;
+    double thumbScaleY;
+    // KFB_SAMPLE_GRID_JITTER: visiting order of the current pass
+    vector<ll> gridOrder;
+    size_t gridPos;
+    ll gridCols;
+    // throughput of kfbsampler_next_batch
+    ll patches;
+    double seconds;
+    // nThreads - 1 workers created with the sampler, the caller of kfbsampler_next_batch is the last one
+    vector<thread> workers;
+    mutex jobLock;
+    condition_variable jobReady;
+    condition_variable jobDone;
+    uint64_t job;           // incremented for every batch
+    int running;            // workers still busy with the current batch
+    bool stopping;
+    // the current batch
+    int batchSize;
+    int layout;
+    BYTE* dest;
+    vector<ll> xs;
+    vector<ll> ys;
+    atomic<int> next;
+    atomic<bool> ok;
+    vector<BYTE> tile;      // CHW scratch of the calling thread
+
+    PatchSampler() {
+        s = nullptr;
+        level = patchSize = policy = nThreads = 0;
+        levelWidth = levelHeight = 0;
+        rng = 0;
+        thumbWidth = 0;
+        thumbScaleX = thumbScaleY = 0;
+        gridPos = 0;
+        gridCols = 0;
+        patches = 0;
+        seconds = 0;
+        job = 0;
+        running = 0;
+        stopping = false;
+        batchSize = layout = 0;
+        dest = nullptr;
+        next = 0;
+        ok = true;
+    }
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/**
+ * Create a patch sampler on an opened slide.
+ *
+ * @param level The level patches are read from.
+ * @param patchSize Width and height of a patch at @p level.
+ * @param policy One of KfbSamplePolicy. KFB_SAMPLE_TISSUE falls back to
+ *               uniform sampling if the slide has no usable thumbnail.
+ * @param seed Seed of the coordinate generator.
+ * @param nThreads Number of decoding threads kept by the sampler, 0 for the number of CPUs.
+ * @return NULL if the level is out of range or smaller than a patch.
+ */
+PatchSampler* kfbsampler_create(ImgHandle* s, int level, int patchSize, int policy, uint64_t seed, int nThreads);
+
+// Restart the coordinate sequence, the same seed gives the same batches again.
+void kfbsampler_reset(PatchSampler* sampler, uint64_t seed);
+
+/**
+ * Sample @p batchSize patches and decode them into @p dest.
+ *
+ * @param layout One of KfbBatchLayout.
+ * @param dest Contiguous uint8 buffer of (batchSize * 3 * patchSize * patchSize) bytes.
+ * @param coords Optional, receives (x, y) of every patch in the level 0 reference frame.
+ * @return false if any patch failed to read, failed patches are filled with 0.
+ */
+bool kfbsampler_next_batch(PatchSampler* sampler, int batchSize, int layout, BYTE* dest, int* coords);
+
+// Patches per second over all kfbsampler_next_batch() calls so far.
+double kfbsampler_patches_per_second(PatchSampler* sampler);
+
+void kfbsampler_destroy(PatchSampler* sampler);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,520 @@
+#include <algorithm>
+#include "kfbstain.h"
+#include "kfbdecode.h"
+
+/*
+    SIMD primitives
+    每个后端提供 vf (KFB_LANES 个 float) 以及 exp/log 所需的位运算, 内核只写一次
+*/
+static const float LN2_HI = 0.693359375f;
+static const float LN2_LO = -2.12194440e-4f;
+static const float LN2 = 0.693147181f;
+static const float LOG2E = 1.44269504f;
+static const float SQRT2 = 1.41421356f;
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define KFB_LANES 8
+typedef __m256 vf;
+static inline vf vset(float x) { return _mm256_set1_ps(x); }
+static inline vf vload(const float* p) { return _mm256_loadu_ps(p); }
+static inline void vstore(float* p, vf v) { _mm256_storeu_ps(p, v); }
+static inline vf vadd(vf a, vf b) { return _mm256_add_ps(a, b); }
+static inline vf vmul(vf a, vf b) { return _mm256_mul_ps(a, b); }
+static inline vf vdiv(vf a, vf b) { return _mm256_div_ps(a, b); }
+static inline vf vfma(vf a, vf b, vf c) { return _mm256_fmadd_ps(a, b, c); }
+static inline vf vmin(vf a, vf b) { return _mm256_min_ps(a, b); }
+static inline vf vmax(vf a, vf b) { return _mm256_max_ps(a, b); }
+static inline vf vround(vf x) { return _mm256_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+// a >= b ? x : y
+static inline vf vselge(vf a, vf b, vf x, vf y) { return _mm256_blendv_ps(y, x, _mm256_cmp_ps(a, b, _CMP_GE_OQ)); }
+// 2^n for integral n in [-126, 127]
+static inline vf vpow2i(vf n) {
+    __m256i e = _mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(e, 23));
+}
+// x = m * 2^e with m in [sqrt(2)/2, sqrt(2)], x must be a positive normal number
+static inline vf vfrexp(vf x, vf* e) {
+    __m256i bits = _mm256_castps_si256(x);
+    __m256i exponent = _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127));
+    vf m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x7fffff)),
+                                               _mm256_set1_epi32(0x3f800000)));
+    vf big = _mm256_cmp_ps(m, vset(SQRT2), _CMP_GT_OQ);
+    *e = vadd(_mm256_cvtepi32_ps(exponent), _mm256_and_ps(big, vset(1.0f)));
+    return _mm256_blendv_ps(m, vmul(m, vset(0.5f)), big);
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define KFB_LANES 4
+typedef float32x4_t vf;
+static inline vf vset(float x) { return vdupq_n_f32(x); }
+static inline vf vload(const float* p) { return vld1q_f32(p); }
+static inline void vstore(float* p, vf v) { vst1q_f32(p, v); }
+static inline vf vadd(vf a, vf b) { return vaddq_f32(a, b); }
+static inline vf vmul(vf a, vf b) { return vmulq_f32(a, b); }
+static inline vf vdiv(vf a, vf b) { return vdivq_f32(a, b); }
+static inline vf vfma(vf a, vf b, vf c) { return vfmaq_f32(c, a, b); }
+static inline vf vmin(vf a, vf b) { return vminq_f32(a, b); }
+static inline vf vmax(vf a, vf b) { return vmaxq_f32(a, b); }
+static inline vf vround(vf x) { return vrndnq_f32(x); }
+static inline vf vselge(vf a, vf b, vf x, vf y) { return vbslq_f32(vcgeq_f32(a, b), x, y); }
+static inline vf vpow2i(vf n) {
+    int32x4_t e = vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127));
+    return vreinterpretq_f32_s32(vshlq_n_s32(e, 23));
+}
+static inline vf vfrexp(vf x, vf* e) {
+    uint32x4_t bits = vreinterpretq_u32_f32(x);
+    int32x4_t exponent = vsubq_s32(vreinterpretq_s32_u32(vshrq_n_u32(bits, 23)), vdupq_n_s32(127));
+    vf m = vreinterpretq_f32_u32(vorrq_u32(vandq_u32(bits, vdupq_n_u32(0x7fffff)), vdupq_n_u32(0x3f800000)));
+    uint32x4_t big = vcgtq_f32(m, vset(SQRT2));
+    *e = vaddq_f32(vcvtq_f32_s32(exponent), vreinterpretq_f32_u32(vandq_u32(big, vreinterpretq_u32_f32(vset(1.0f)))));
+    return vbslq_f32(big, vmul(m, vset(0.5f)), m);
+}
+#else
+#define KFB_LANES 1
+typedef float vf;
+static inline vf vset(float x) { return x; }
+static inline vf vload(const float* p) { return *p; }
+static inline void vstore(float* p, vf v) { *p = v; }
+static inline vf vadd(vf a, vf b) { return a + b; }
+static inline vf vmul(vf a, vf b) { return a * b; }
+static inline vf vdiv(vf a, vf b) { return a / b; }
+static inline vf vfma(vf a, vf b, vf c) { return a * b + c; }
+static inline vf vmin(vf a, vf b) { return a < b ? a : b; }
+static inline vf vmax(vf a, vf b) { return a > b ? a : b; }
+static inline vf vround(vf x) { return nearbyintf(x); }
+static inline vf vselge(vf a, vf b, vf x, vf y) { return a >= b ? x : y; }
+static inline vf vpow2i(vf n) { return ldexpf(1.0f, (int)n); }
+static inline vf vfrexp(vf x, vf* e) {
+    int exponent;
+    float m = frexpf(x, &exponent) * 2.0f;
+    exponent -= 1;
+    if(m > SQRT2) {
+        m *= 0.5f;
+        exponent += 1;
+    }
+    *e = (float)exponent;
+    return m;
+}
+#endif
+
+// exp(x) = 2^n * exp(r), |r| <= ln2 / 2, Taylor series up to r^6
+static inline vf vexp(vf x) {
+    x = vmin(vmax(x, vset(-87.0f)), vset(88.0f));
+    vf n = vround(vmul(x, vset(LOG2E)));
+    vf r = vfma(n, vset(-LN2_HI), x);
+    r = vfma(n, vset(-LN2_LO), r);
+    vf p = vset(1.0f / 720);
+    p = vfma(p, r, vset(1.0f / 120));
+    p = vfma(p, r, vset(1.0f / 24));
+    p = vfma(p, r, vset(1.0f / 6));
+    p = vfma(p, r, vset(0.5f));
+    p = vfma(p, r, vset(1.0f));
+    p = vfma(p, r, vset(1.0f));
+    return vmul(p, vpow2i(n));
+}
+
+// log(x) = e * ln2 + log(m), log(m) = 2 * atanh(s) with s = (m - 1) / (m + 1)
+static inline vf vlog(vf x) {
+    vf e;
+    vf m = vfrexp(x, &e);
+    vf s = vdiv(vadd(m, vset(-1.0f)), vadd(m, vset(1.0f)));
+    vf s2 = vmul(s, s);
+    vf p = vset(1.0f / 9);
+    p = vfma(p, s2, vset(1.0f / 7));
+    p = vfma(p, s2, vset(1.0f / 5));
+    p = vfma(p, s2, vset(1.0f / 3));
+    p = vfma(p, s2, vset(1.0f));
+    return vfma(e, vset(LN2), vmul(vmul(s, vset(2.0f)), p));
+}
+
+static inline void vmat3(const float M[9], const vf in[3], vf out[3]) {
+    for(int j = 0; j < 3; j++)
+        out[j] = vfma(vset(M[3 * j]), in[0], vfma(vset(M[3 * j + 1]), in[1], vmul(vset(M[3 * j + 2]), in[2])));
+}
+
+/*
+    Pixel chunks
+*/
+struct Luts {
+    float od[256];
+    float value[256];
+
+    Luts() {
+        for(int i = 0; i < 256; i++) {
+            od[i] = max(0.0f, -logf((i + 1) / KFB_STAIN_IO));
+            value[i] = (float)i;
+        }
+    }
+};
+
+static const Luts& luts() {
+    static Luts l;
+    return l;
+}
+
+// 读取最多 KFB_LANES 个像素到平面格式, 不足的 lane 填 0, 返回有效像素数
+static inline int loadChunk(const BYTE* rgb, ll nPixels, ll i, const float* lut, vf out[3]) {
+    float planes[3][KFB_LANES] = {};
+    int m = (int)min<ll>(KFB_LANES, nPixels - i);
+    const BYTE* p = rgb + i * 3;
+    for(int k = 0; k < m; k++) {
+        planes[0][k] = lut[p[3 * k]];
+        planes[1][k] = lut[p[3 * k + 1]];
+        planes[2][k] = lut[p[3 * k + 2]];
+    }
+    for(int j = 0; j < 3; j++) out[j] = vload(planes[j]);
+    return m;
+}
+
+static inline void storeChunkBytes(const vf in[3], int m, BYTE* dest) {
+    float planes[3][KFB_LANES];
+    for(int j = 0; j < 3; j++) vstore(planes[j], vmin(vmax(in[j], vset(0.0f)), vset(255.0f)));
+    for(int k = 0; k < m; k++)
+        for(int j = 0; j < 3; j++) dest[3 * k + j] = (BYTE)(planes[j][k] + 0.5f);
+}
+
+static inline void storeChunkFloats(const vf in[3], int m, float* dest) {
+    float planes[3][KFB_LANES];
+    for(int j = 0; j < 3; j++) vstore(planes[j], in[j]);
+    for(int k = 0; k < m; k++)
+        for(int j = 0; j < 3; j++) dest[3 * k + j] = planes[j][k];
+}
+
+/*
+    Kernels, rgb and dest may alias because a chunk is loaded before it is stored
+*/
+// dest = K * OD, K == NULL for OD itself
+static void odKernel(const BYTE* rgb, ll nPixels, const float* K, float* dest) {
+    const float* lut = luts().od;
+    vf od[3], out[3];
+    for(ll i = 0; i < nPixels; i += KFB_LANES) {
+        int m = loadChunk(rgb, nPixels, i, lut, od);
+        if(K) vmat3(K, od, out);
+        storeChunkFloats(K ? out : od, m, dest + i * 3);
+    }
+}
+
+// dest = Io * exp(-K * OD)
+static void macenkoKernel(const BYTE* rgb, ll nPixels, const float K[9], BYTE* dest) {
+    const float* lut = luts().od;
+    vf od[3], out[3];
+    for(ll i = 0; i < nPixels; i += KFB_LANES) {
+        int m = loadChunk(rgb, nPixels, i, lut, od);
+        vmat3(K, od, out);
+        for(int j = 0; j < 3; j++) out[j] = vmul(vset(KFB_STAIN_IO), vexp(vmul(out[j], vset(-1.0f))));
+        storeChunkBytes(out, m, dest + i * 3);
+    }
+}
+
+// dest = R * exp(A * log(L * rgb) + b), background pixels (luma >= background) are copied unchanged
+static void reinhardKernel(const BYTE* rgb, ll nPixels, const float L[9], const float A[9], const float b[3],
+                           const float R[9], float background, BYTE* dest) {
+    const float* lut = luts().value;
+    vf in[3], lms[3], out[3];
+    for(ll i = 0; i < nPixels; i += KFB_LANES) {
+        int m = loadChunk(rgb, nPixels, i, lut, in);
+        vmat3(L, in, lms);
+        for(int j = 0; j < 3; j++) lms[j] = vlog(vmax(lms[j], vset(1.0f)));
+        vmat3(A, lms, out);
+        for(int j = 0; j < 3; j++) lms[j] = vexp(vadd(out[j], vset(b[j])));
+        vmat3(R, lms, out);
+        vf luma = vfma(vset(0.299f), in[0], vfma(vset(0.587f), in[1], vmul(vset(0.114f), in[2])));
+        for(int j = 0; j < 3; j++) out[j] = vselge(luma, vset(background), in[j], out[j]);
+        storeChunkBytes(out, m, dest + i * 3);
+    }
+}
+
+/*
+    3x3 matrices, row major
+*/
+static void mat3Mul(const float A[9], const float B[9], float C[9]) {
+    float T[9];
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++)
+            T[3 * i + j] = A[3 * i] * B[j] + A[3 * i + 1] * B[3 + j] + A[3 * i + 2] * B[6 + j];
+    memcpy(C, T, sizeof(T));
+}
+
+static bool mat3Inv(const float A[9], float B[9]) {
+    double det = (double)A[0] * (A[4] * A[8] - A[5] * A[7])
+               - (double)A[1] * (A[3] * A[8] - A[5] * A[6])
+               + (double)A[2] * (A[3] * A[7] - A[4] * A[6]);
+    if(fabs(det) < 1e-12) return false;
+    B[0] = (A[4] * A[8] - A[5] * A[7]) / det;
+    B[1] = (A[2] * A[7] - A[1] * A[8]) / det;
+    B[2] = (A[1] * A[5] - A[2] * A[4]) / det;
+    B[3] = (A[5] * A[6] - A[3] * A[8]) / det;
+    B[4] = (A[0] * A[8] - A[2] * A[6]) / det;
+    B[5] = (A[2] * A[3] - A[0] * A[5]) / det;
+    B[6] = (A[3] * A[7] - A[4] * A[6]) / det;
+    B[7] = (A[1] * A[6] - A[0] * A[7]) / det;
+    B[8] = (A[0] * A[4] - A[1] * A[3]) / det;
+    return true;
+}
+
+// (H^T H)^-1 H^T of a 3x2 stain matrix
+static bool pinv32(const float H[3][2], float P[2][3]) {
+    double a = 0, b = 0, d = 0;
+    for(int i = 0; i < 3; i++) {
+        a += H[i][0] * H[i][0];
+        b += H[i][0] * H[i][1];
+        d += H[i][1] * H[i][1];
+    }
+    double det = a * d - b * b;
+    if(fabs(det) < 1e-12) return false;
+    for(int i = 0; i < 3; i++) {
+        P[0][i] = (d * H[i][0] - b * H[i][1]) / det;
+        P[1][i] = (a * H[i][1] - b * H[i][0]) / det;
+    }
+    return true;
+}
+
+// Eigen decomposition of a symmetric 3x3 matrix by cyclic Jacobi rotations, V holds eigenvectors as columns
+static void jacobi3(double A[3][3], double w[3], double V[3][3]) {
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++) V[i][j] = i == j;
+    for(int sweep = 0; sweep < 32; sweep++) {
+        double off = fabs(A[0][1]) + fabs(A[0][2]) + fabs(A[1][2]);
+        if(off < 1e-15) break;
+        for(int p = 0; p < 2; p++)
+            for(int q = p + 1; q < 3; q++) {
+                if(fabs(A[p][q]) < 1e-18) continue;
+                double theta = (A[q][q] - A[p][p]) / (2 * A[p][q]);
+                double t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+                double c = 1 / sqrt(t * t + 1), s = t * c;
+                for(int k = 0; k < 3; k++) {
+                    double akp = A[k][p], akq = A[k][q];
+                    A[k][p] = c * akp - s * akq;
+                    A[k][q] = s * akp + c * akq;
+                }
+                for(int k = 0; k < 3; k++) {
+                    double apk = A[p][k], aqk = A[q][k];
+                    A[p][k] = c * apk - s * aqk;
+                    A[q][k] = s * apk + c * aqk;
+                }
+                for(int k = 0; k < 3; k++) {
+                    double vkp = V[k][p], vkq = V[k][q];
+                    V[k][p] = c * vkp - s * vkq;
+                    V[k][q] = s * vkp + c * vkq;
+                }
+            }
+    }
+    for(int i = 0; i < 3; i++) w[i] = A[i][i];
+}
+
+/*
+    Color spaces
+*/
+// RGB -> LMS and l-alpha-beta (Reinhard et al. 2001)
+static const float RGB2LMS[9] = {0.3811f, 0.5783f, 0.0402f,
+                                 0.1967f, 0.7244f, 0.0782f,
+                                 0.0241f, 0.1288f, 0.8444f};
+static const float LMS2LAB[9] = {0.57735027f, 0.57735027f, 0.57735027f,
+                                 0.40824829f, 0.40824829f, -0.81649658f,
+                                 0.70710678f, -0.70710678f, 0.0f};
+// Ruifrok & Johnston, rows are the OD vectors of hematoxylin, eosin and DAB
+static const float RGB_FROM_HED[9] = {0.65f, 0.70f, 0.29f,
+                                      0.07f, 0.99f, 0.11f,
+                                      0.27f, 0.57f, 0.78f};
+static const float OD_BETA = 0.15f;
+static const float BACKGROUND_LUMA = 220.0f;
+static const ll MIN_TISSUE_PIXELS = 100;
+
+// Targets from HistomicsTK (Reinhard) and Macenko et al. 2009
+static StainStats defaultReference() {
+    StainStats st;
+    const float labMean[3] = {8.74108109f, -0.12440419f, 0.0444982f};
+    const float labStd[3] = {0.6135447f, 0.10989545f, 0.0286032f};
+    const float stainMatrix[3][2] = {{0.5626f, 0.2159f}, {0.7201f, 0.8012f}, {0.4062f, 0.5581f}};
+    const float maxConc[2] = {1.9705f, 1.0308f};
+    memcpy(st.labMean, labMean, sizeof(labMean));
+    memcpy(st.labStd, labStd, sizeof(labStd));
+    memcpy(st.stainMatrix, stainMatrix, sizeof(stainMatrix));
+    memcpy(st.maxConc, maxConc, sizeof(maxConc));
+    st.estimated = st.reinhardValid = st.macenkoValid = true;
+    return st;
+}
+
+static float percentile(vector<float>& v, double p) {
+    size_t k = min(v.size() - 1, (size_t)(p / 100 * (v.size() - 1) + 0.5));
+    nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+static bool estimateMacenko(const vector<float>& od, StainStats& st);
+
+static bool estimateStats(const BYTE* rgb, ll nPixels, StainStats& st) {
+    const float* odLut = luts().od;
+    vector<float> od;
+    double sum[3] = {0, 0, 0}, sq[3] = {0, 0, 0};
+    ll nTissue = 0;
+    for(ll i = 0; i < nPixels; i++) {
+        const BYTE* p = rgb + i * 3;
+        float o[3] = {odLut[p[0]], odLut[p[1]], odLut[p[2]]};
+        // Macenko: pixels nearly transparent in any channel do not constrain the stain plane
+        if(o[0] >= OD_BETA && o[1] >= OD_BETA && o[2] >= OD_BETA) od.insert(od.end(), o, o + 3);
+        // Reinhard: all tissue, only the near-white background is left out (eosin has little OD in red)
+        if(0.299f * p[0] + 0.587f * p[1] + 0.114f * p[2] >= BACKGROUND_LUMA) continue;
+        nTissue++;
+        float lms[3], lab[3];
+        for(int j = 0; j < 3; j++)
+            lms[j] = logf(max(1.0f, RGB2LMS[3 * j] * p[0] + RGB2LMS[3 * j + 1] * p[1] + RGB2LMS[3 * j + 2] * p[2]));
+        for(int j = 0; j < 3; j++) {
+            lab[j] = LMS2LAB[3 * j] * lms[0] + LMS2LAB[3 * j + 1] * lms[1] + LMS2LAB[3 * j + 2] * lms[2];
+            sum[j] += lab[j];
+            sq[j] += (double)lab[j] * lab[j];
+        }
+    }
+    // Reinhard
+    st.reinhardValid = nTissue >= MIN_TISSUE_PIXELS;
+    for(int j = 0; st.reinhardValid && j < 3; j++) {
+        st.labMean[j] = sum[j] / nTissue;
+        st.labStd[j] = sqrt(max(0.0, sq[j] / nTissue - (sum[j] / nTissue) * (sum[j] / nTissue)));
+        if(st.labStd[j] < 1e-6f) st.reinhardValid = false;
+    }
+    st.macenkoValid = estimateMacenko(od, st);
+    return st.reinhardValid || st.macenkoValid;
+}
+
+// Macenko: plane of the two largest principal components of OD
+static bool estimateMacenko(const vector<float>& od, StainStats& st) {
+    ll n = od.size() / 3;
+    if(n < MIN_TISSUE_PIXELS) return false;
+    double mean[3] = {0, 0, 0}, cov[3][3] = {{0}};
+    for(ll i = 0; i < n; i++)
+        for(int j = 0; j < 3; j++) mean[j] += od[3 * i + j];
+    for(int j = 0; j < 3; j++) mean[j] /= n;
+    for(ll i = 0; i < n; i++)
+        for(int j = 0; j < 3; j++)
+            for(int k = 0; k < 3; k++) cov[j][k] += (od[3 * i + j] - mean[j]) * (od[3 * i + k] - mean[k]);
+    double w[3], V[3][3];
+    jacobi3(cov, w, V);
+    int order[3] = {0, 1, 2};
+    sort(order, order + 3, [&](int a, int b) { return w[a] > w[b]; });
+    float v1[3], v2[3];
+    float sign = V[0][order[0]] < 0 ? -1.0f : 1.0f;
+    for(int j = 0; j < 3; j++) {
+        v1[j] = sign * V[j][order[0]];
+        v2[j] = V[j][order[1]];
+    }
+    vector<float> phi(n);
+    for(ll i = 0; i < n; i++) {
+        const float* o = &od[3 * i];
+        phi[i] = atan2f(o[0] * v2[0] + o[1] * v2[1] + o[2] * v2[2], o[0] * v1[0] + o[1] * v1[1] + o[2] * v1[2]);
+    }
+    float minPhi = percentile(phi, 1), maxPhi = percentile(phi, 99);
+    float vMin[3], vMax[3];
+    for(int j = 0; j < 3; j++) {
+        vMin[j] = v1[j] * cosf(minPhi) + v2[j] * sinf(minPhi);
+        vMax[j] = v1[j] * cosf(maxPhi) + v2[j] * sinf(maxPhi);
+    }
+    // hematoxylin absorbs more red than eosin
+    bool minIsH = vMin[0] > vMax[0];
+    for(int j = 0; j < 3; j++) {
+        st.stainMatrix[j][0] = minIsH ? vMin[j] : vMax[j];
+        st.stainMatrix[j][1] = minIsH ? vMax[j] : vMin[j];
+    }
+    float P[2][3];
+    if(!pinv32(st.stainMatrix, P)) return false;
+    vector<float> conc[2] = {vector<float>(n), vector<float>(n)};
+    for(ll i = 0; i < n; i++) {
+        const float* o = &od[3 * i];
+        for(int c = 0; c < 2; c++) conc[c][i] = P[c][0] * o[0] + P[c][1] * o[1] + P[c][2] * o[2];
+    }
+    for(int c = 0; c < 2; c++) {
+        st.maxConc[c] = percentile(conc[c], 99);
+        if(st.maxConc[c] < 1e-6f) return false;
+    }
+    return true;
+}
+
+bool kfbslide_estimate_stain(ImgHandle* s) {
+    // other threads wait for the first estimate instead of seeing a half-filled StainStats
+    lock_guard<mutex> guard(s->stain_lock);
+    StainStats& st = s->stain;
+    if(st.estimated) return st.reinhardValid || st.macenkoValid;
+    kfbslide_get_associated_image_names(s);
+    AssoImage thumbnail;
+    {
+        lock_guard<mutex> assoGuard(s->asso_lock);
+        auto iter = s->assoImages.find("thumbnail");
+        if(iter != s->assoImages.end()) thumbnail = iter->second;
+    }
+    vector<BYTE> rgb;
+    int width = 0, height = 0;
+    StainStats estimate;
+    if(thumbnail.buf && kfb_decode_jpeg(thumbnail.buf.get(), thumbnail.nBytes, rgb, &width, &height))
+        estimateStats(rgb.data(), (ll)width * height, estimate);
+    st = estimate;
+    st.estimated = true;
+    return st.reinhardValid || st.macenkoValid;
+}
+
+static bool stainValid(const StainStats& st, int method) {
+    return method == KFB_STAIN_REINHARD ? st.reinhardValid : method == KFB_STAIN_MACENKO && st.macenkoValid;
+}
+
+bool kfbslide_stain_normalize(ImgHandle* s, ImgHandle* ref, int method, const BYTE* rgb, ll nPixels, BYTE* dest) {
+    if(!rgb || !dest || nPixels < 0) return false;
+    if(method == KFB_STAIN_NONE) {
+        if(dest != rgb) memmove(dest, rgb, nPixels * 3);
+        return true;
+    }
+    if(!kfbslide_estimate_stain(s) || !stainValid(s->stain, method)) return false;
+    StainStats target = defaultReference();
+    if(ref) {
+        if(!kfbslide_estimate_stain(ref) || !stainValid(ref->stain, method)) return false;
+        target = ref->stain;
+    }
+    const StainStats& source = s->stain;
+
+    if(method == KFB_STAIN_REINHARD) {
+        // the affine map in l-alpha-beta space is folded into log-LMS space:
+        // A = LAB2LMS * D * LMS2LAB, b = LAB2LMS * (mean_t - D * mean_s)
+        float lab2lms[9], lms2rgb[9], D[9] = {0}, A[9], b[3], shift[3];
+        if(!mat3Inv(LMS2LAB, lab2lms) || !mat3Inv(RGB2LMS, lms2rgb)) return false;
+        for(int j = 0; j < 3; j++) {
+            D[4 * j] = target.labStd[j] / source.labStd[j];
+            shift[j] = target.labMean[j] - D[4 * j] * source.labMean[j];
+        }
+        mat3Mul(D, LMS2LAB, A);
+        mat3Mul(lab2lms, A, A);
+        for(int j = 0; j < 3; j++)
+            b[j] = lab2lms[3 * j] * shift[0] + lab2lms[3 * j + 1] * shift[1] + lab2lms[3 * j + 2] * shift[2];
+        reinhardKernel(rgb, nPixels, RGB2LMS, A, b, lms2rgb, BACKGROUND_LUMA, dest);
+        return true;
+    }
+    if(method == KFB_STAIN_MACENKO) {
+        // OD' = HE_t * diag(maxC_t / maxC_s) * pinv(HE_s) * OD
+        float P[2][3], K[9];
+        if(!pinv32(source.stainMatrix, P)) return false;
+        for(int i = 0; i < 3; i++)
+            for(int j = 0; j < 3; j++) {
+                K[3 * i + j] = 0;
+                for(int c = 0; c < 2; c++)
+                    K[3 * i + j] += target.stainMatrix[i][c] * (target.maxConc[c] / source.maxConc[c]) * P[c][j];
+            }
+        macenkoKernel(rgb, nPixels, K, dest);
+        return true;
+    }
+    return false;
+}
+
+void kfbslide_rgb_to_od(const BYTE* rgb, ll nPixels, float* dest) {
+    odKernel(rgb, nPixels, nullptr, dest);
+}
+
+void kfbslide_rgb_to_hed(const BYTE* rgb, ll nPixels, float* dest) {
+    // OD (row vector) = C * RGB_FROM_HED, so C = (RGB_FROM_HED^-1)^T * OD
+    float inv[9], K[9];
+    mat3Inv(RGB_FROM_HED, inv);
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++) K[3 * i + j] = inv[3 * j + i];
+    odKernel(rgb, nPixels, K, dest);
+}
+
+bool kfbslide_get_image_roi_normalized(ImgHandle* s, ImgHandle* ref, int method, int level, int x, int y, int width, int height, BYTE* dest) {
+    if(!kfbslide_get_image_roi_rgb(s, level, x, y, width, height, dest)) return false;
+    return kfbslide_stain_normalize(s, ref, method, dest, (ll)width * height, dest);
+}
@@ -0,0 +1,63 @@
+#ifndef __KFBSTAIN__
+#define __KFBSTAIN__
+#include "kfbreader.h"
+
+// 解码后的可选处理: 光密度 (OD), HED 颜色反卷积, Reinhard / Macenko 染色归一化
+// 内核按编译目标选择 AVX2 (-mavx2 -mfma), NEON (aarch64) 或标量实现
+
+enum KfbStainMethod {
+    KFB_STAIN_NONE = 0,
+    KFB_STAIN_REINHARD,
+    KFB_STAIN_MACENKO
+};
+
+// Background intensity used for optical density, OD = max(0, -ln((I + 1) / KFB_STAIN_IO))
+#define KFB_STAIN_IO 240.0f
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/**
+ * Estimate the stain statistics of a slide from its thumbnail.
+ *
+ * The result is cached in s->stain, later calls return immediately.
+ * Reinhard and Macenko statistics are estimated separately,
+ * s->stain.reinhardValid and s->stain.macenkoValid tell which succeeded.
+ *
+ * @return false if the slide has no thumbnail or neither estimate succeeded.
+ */
+bool kfbslide_estimate_stain(ImgHandle* s);
+
+/**
+ * Normalize the stain of decoded RGB pixels.
+ *
+ * Reinhard statistics cover all tissue of the thumbnail, near-white background
+ * pixels (luma >= 220) are left out of them and copied unchanged.
+ *
+ * @param s The slide the pixels come from.
+ * @param ref The reference slide, or NULL for the built-in H&E reference.
+ * @param method KFB_STAIN_REINHARD or KFB_STAIN_MACENKO.
+ * @param rgb Interleaved RGB pixels.
+ * @param dest Output buffer of (nPixels * 3) bytes, may be the same as @p rgb.
+ * @return false if the statistics of @p method cannot be estimated for @p s or @p ref,
+ *         @p dest is left untouched in that case.
+ */
+bool kfbslide_stain_normalize(ImgHandle* s, ImgHandle* ref, int method, const BYTE* rgb, ll nPixels, BYTE* dest);
+
+// Optical density of each channel, dest holds (nPixels * 3) floats.
+void kfbslide_rgb_to_od(const BYTE* rgb, ll nPixels, float* dest);
+
+// Hematoxylin, eosin and DAB concentrations (Ruifrok & Johnston), dest holds (nPixels * 3) floats.
+void kfbslide_rgb_to_hed(const BYTE* rgb, ll nPixels, float* dest);
+
+/**
+ * Read a region, decode it and normalize its stain straight into @p dest.
+ *
+ * Same arguments as kfbslide_get_image_roi_rgb(), plus @p ref and @p method
+ * as in kfbslide_stain_normalize(). KFB_STAIN_NONE only decodes.
+ */
+bool kfbslide_get_image_roi_normalized(ImgHandle* s, ImgHandle* ref, int method, int level, int x, int y, int width, int height, BYTE* dest);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,140 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <jpeglib.h>
+#include "KFB.h"
+
+// libImageOperationLib.so 的合成替身: 导出 kfbslide_* 用到的函数, 返回按坐标生成的 JPEG,
+// 用于在没有厂商库和真实切片的机器上测试与回放 (kfbreplay).
+//   g++ -O2 -shared -fPIC kfbstub.cpp -o libkfbstub.so -ljpeg
+// Environment:
+//   KFB_STUB_WIDTH, KFB_STUB_HEIGHT  level 0 size, default 8192 x 6144
+//   KFB_STUB_BLOCK_SIZE              side of the GetImageStreamFunc blocks, default 256
+//   KFB_STUB_DELAY_US                extra latency of every image call, emulates slow storage
+
+static const int SCAN_SCALE = 40;
+
+static int envInt(const char* name, int value) {
+    const char* v = getenv(name);
+    return v ? atoi(v) : value;
+}
+
+static int slideWidth() { return envInt("KFB_STUB_WIDTH", 8192); }
+static int slideHeight() { return envInt("KFB_STUB_HEIGHT", 6144); }
+static int blockSize() { return envInt("KFB_STUB_BLOCK_SIZE", 256); }
+
+static void delay() {
+    int us = envInt("KFB_STUB_DELAY_US", 0);
+    if(us > 0) std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+// The buffer is allocated with new[] like the vendor library, kfbslide_buffer_free() deletes it.
+static BYTE* encode(int x0, int y0, int w, int h, int* nBytes) {
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr err;
+    cinfo.err = jpeg_std_error(&err);
+    jpeg_create_compress(&cinfo);
+    unsigned char* mem = nullptr;
+    unsigned long memSize = 0;
+    jpeg_mem_dest(&cinfo, &mem, &memSize);
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 85, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    std::vector<BYTE> row((size_t)w * 3);
+    while(cinfo.next_scanline < cinfo.image_height) {
+        int y = y0 + cinfo.next_scanline;
+        for(int x = 0; x < w; x++) {
+            row[3 * x] = 200 + (x0 + x) % 40;
+            row[3 * x + 1] = 120 + y % 80;
+            row[3 * x + 2] = 180 + (x0 + x + y) % 60;
+        }
+        BYTE* ptr = row.data();
+        jpeg_write_scanlines(&cinfo, &ptr, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    BYTE* buf = new BYTE[memSize];
+    memcpy(buf, mem, memSize);
+    free(mem);
+    *nBytes = memSize;
+    return buf;
+}
+
+static bool associated(BYTE** buf, int* nBytes, int* width, int* height, int w, int h) {
+    delay();
+    *buf = encode(0, 0, w, h, nBytes);
+    *width = w;
+    *height = h;
+    return true;
+}
+
+extern "C" {
+int InitImageFileFunc(ImageInfoStruct* info, const char* path) {
+    if(!path || !*path) return 0;
+    info->DataFilePTR = 1;
+    return 1;
+}
+
+int GetHeaderInfoFunc(ImageInfoStruct*, KFB_INT32* height, KFB_INT32* width, KFB_INT32* scanScale, float* spendTime,
+                      double* scanTime, float* capRes, KFB_INT32* blockSize) {
+    *height = slideHeight();
+    *width = slideWidth();
+    *scanScale = SCAN_SCALE;
+    *spendTime = 0;
+    *scanTime = 0;
+    *capRes = 0.25f;
+    *blockSize = ::blockSize();
+    return 1;
+}
+
+void* GetImageStreamFunc(ImageInfoStruct*, float fScale, int x, int y, int* nBytes, BYTE** buf) {
+    delay();
+    int downsample = std::max(1, (int)(SCAN_SCALE / fScale + 0.5f));
+    int w = std::min(blockSize(), slideWidth() / downsample - x), h = std::min(blockSize(), slideHeight() / downsample - y);
+    if(x < 0 || y < 0 || w <= 0 || h <= 0) {
+        *nBytes = 0;
+        *buf = nullptr;
+        return nullptr;
+    }
+    *buf = encode(x, y, w, h, nBytes);
+    return *buf;
+}
+
+int GetImageDataRoiFunc(ImageInfoStruct*, float, KFB_INT32 x, KFB_INT32 y, KFB_INT32 width, KFB_INT32 height,
+                        BYTE** buf, KFB_INT32* nBytes, bool) {
+    delay();
+    if(width <= 0 || height <= 0) return 0;
+    *buf = encode(x, y, width, height, nBytes);
+    return 1;
+}
+
+bool GetThumnailImageFunc(ImageInfoStruct*, BYTE** buf, int* nBytes, int* width, int* height) {
+    return associated(buf, nBytes, width, height, 1024, 1024 * slideHeight() / slideWidth());
+}
+
+bool GetPriviewInfoFunc(ImageInfoStruct*, BYTE** buf, int* nBytes, int* width, int* height) {
+    return associated(buf, nBytes, width, height, 512, 512 * slideHeight() / slideWidth());
+}
+
+bool GetLableInfoFunc(ImageInfoStruct*, BYTE** buf, int* nBytes, int* width, int* height) {
+    return associated(buf, nBytes, width, height, 256, 256);
+}
+
+int DeleteImageDataFunc(LPVOID data) {
+    delete [] (BYTE*)data;
+    return 1;
+}
+
+int UnInitImageFileFunc(ImageInfoStruct* info) {
+    info->DataFilePTR = 0;
+    return 1;
+}
+}
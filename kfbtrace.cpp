@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+#include <set>
+#include <vector>
+#include "kfbtrace.h"
+
+using namespace std;
+
+atomic<bool> kfb_trace_enabled(false);
+atomic<uint32_t> kfb_trace_generation(0);
+
+static const size_t FLUSH_BYTES = 64 << 10;
+// 加锁顺序: registryLock -> TraceBuffer::lock -> fileLock
+static mutex registryLock;
+static mutex fileLock;
+static FILE* traceFile = nullptr;
+static atomic<int64_t> traceEpoch(0);
+static atomic<uint32_t> threadCounter(0);
+
+struct TraceBuffer;
+// never destroyed, threads still running at exit unregister after static destructors
+static set<TraceBuffer*>& buffers = *new set<TraceBuffer*>;
+
+static int64_t steadyNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct TraceBuffer {
+    mutex lock;
+    vector<char> data;
+    uint32_t thread;
+
+    TraceBuffer() {
+        thread = threadCounter++;
+        data.reserve(FLUSH_BYTES + 1024);
+        lock_guard<mutex> guard(registryLock);
+        buffers.insert(this);
+    }
+
+    ~TraceBuffer() {
+        lock_guard<mutex> guard(registryLock);
+        buffers.erase(this);
+        lock_guard<mutex> bufferGuard(lock);
+        flush();
+    }
+
+    // caller holds lock
+    void flush() {
+        if(data.empty()) return;
+        lock_guard<mutex> guard(fileLock);
+        if(traceFile) fwrite(data.data(), 1, data.size(), traceFile);
+        data.clear();
+    }
+};
+
+static thread_local TraceBuffer threadBuffer;
+
+uint64_t kfb_trace_now() {
+    return steadyNs() - traceEpoch.load(memory_order_relaxed);
+}
+
+void kfb_trace_write(const KfbTraceRecord& record, const char* name, uint32_t generation) {
+    // the trace may have been stopped while the call was running
+    if(!kfb_trace_enabled.load(memory_order_relaxed)) return;
+    TraceBuffer& b = threadBuffer;
+    KfbTraceRecord r = record;
+    size_t length = name ? min<size_t>(strlen(name), UINT16_MAX) : 0;
+    r.thread = b.thread;
+    r.nameLength = length;
+    lock_guard<mutex> guard(b.lock);
+    // started before the current trace, its start is relative to the old epoch
+    if(generation != kfb_trace_generation.load()) return;
+    b.data.insert(b.data.end(), (const char*)&r, (const char*)&r + sizeof(r));
+    if(length) b.data.insert(b.data.end(), name, name + length);
+    if(b.data.size() >= FLUSH_BYTES) b.flush();
+}
+
+bool kfbslide_trace_start(const char* path) {
+    kfbslide_trace_stop();
+    FILE* fp = fopen(path, "wb");
+    if(!fp) return false;
+    KfbTraceFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, KFB_TRACE_MAGIC, sizeof(header.magic));
+    header.version = KFB_TRACE_VERSION;
+    fwrite(&header, sizeof(header), 1, fp);
+    {
+        // calls that passed the enabled check before the last stop may have appended after its flush
+        lock_guard<mutex> guard(registryLock);
+        traceEpoch = steadyNs();
+        kfb_trace_generation++;
+        for(TraceBuffer* b : buffers) {
+            lock_guard<mutex> bufferGuard(b->lock);
+            b->data.clear();
+        }
+        lock_guard<mutex> fileGuard(fileLock);
+        traceFile = fp;
+    }
+    kfb_trace_enabled = true;
+    return true;
+}
+
+void kfbslide_trace_stop() {
+    kfb_trace_enabled = false;
+    lock_guard<mutex> guard(registryLock);
+    for(TraceBuffer* b : buffers) {
+        lock_guard<mutex> bufferGuard(b->lock);
+        b->flush();
+    }
+    lock_guard<mutex> fileGuard(fileLock);
+    if(traceFile) fclose(traceFile);
+    traceFile = nullptr;
+}
+
+// KFB_TRACE=<file> 在加载时开始记录, 退出时写完
+struct TraceFromEnv {
+    TraceFromEnv() {
+        const char* path = getenv("KFB_TRACE");
+        if(path && *path && !kfbslide_trace_start(path)) fprintf(stderr, "Error: cannot create trace %s\n", path);
+    }
+
+    ~TraceFromEnv() {
+        kfbslide_trace_stop();
+    }
+};
+
+static TraceFromEnv traceFromEnv;
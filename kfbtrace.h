@@ -0,0 +1,121 @@
+#ifndef __KFBTRACE__
+#define __KFBTRACE__
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+// kfbslide_* 调用记录: 设置 KFB_TRACE=<file> 或调用 kfbslide_trace_start() 开启.
+// 每个线程先写入自己的缓冲区, 满 64KB 后再追加到文件, 未开启时每次调用只多一次原子读.
+//
+// File layout: KfbTraceFileHeader, then KfbTraceRecord entries, each followed
+// by nameLength bytes (the filename of KFB_TRACE_OPEN, the image name of
+// KFB_TRACE_ASSO_READ). Records of different threads are interleaved.
+
+#define KFB_TRACE_MAGIC "KFBTRACE"
+#define KFB_TRACE_VERSION 1
+
+enum KfbTraceOp {
+    KFB_TRACE_OPEN = 1,
+    KFB_TRACE_CLOSE,
+    KFB_TRACE_READ_REGION,
+    KFB_TRACE_ROI_STREAM,
+    KFB_TRACE_ASSO_NAMES,
+    KFB_TRACE_ASSO_READ,
+    KFB_TRACE_BUFFER_FREE,
+    KFB_TRACE_OP_COUNT
+};
+
+#pragma pack(push, 1)
+struct KfbTraceFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct KfbTraceRecord {
+    uint8_t op;
+    uint8_t ok;
+    uint16_t nameLength;
+    uint32_t thread;        // sequential id of the calling thread
+    uint32_t slide;         // ImgHandle::traceId
+    int32_t level;
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+    int64_t bytes;
+    uint64_t buffer;        // address of the returned or freed buffer, pairs reads with kfbslide_buffer_free
+    uint64_t start;         // ns since the trace started
+    uint64_t duration;      // ns
+};
+#pragma pack(pop)
+
+extern std::atomic<bool> kfb_trace_enabled;
+// bumped by every kfbslide_trace_start(), records of an older trace are dropped
+extern std::atomic<uint32_t> kfb_trace_generation;
+
+// Append a finished record of the trace @p generation, called by KfbTraceScope.
+void kfb_trace_write(const KfbTraceRecord& record, const char* name, uint32_t generation);
+
+uint64_t kfb_trace_now();
+
+// Records one call from construction to destruction.
+class KfbTraceScope {
+public:
+    KfbTraceScope(int op, uint32_t slide, int level = 0, int x = 0, int y = 0, int width = 0, int height = 0, const char* name = nullptr) {
+        active = kfb_trace_enabled.load(std::memory_order_relaxed);
+        if(!active) return;
+        record = KfbTraceRecord();
+        record.op = op;
+        record.slide = slide;
+        record.level = level;
+        record.x = x;
+        record.y = y;
+        record.width = width;
+        record.height = height;
+        // the generation before the epoch: kfbslide_trace_start() sets them in the opposite order
+        generation = kfb_trace_generation.load();
+        record.start = kfb_trace_now();
+        this->name = name;
+    }
+
+    ~KfbTraceScope() {
+        if(!active) return;
+        record.duration = kfb_trace_now() - record.start;
+        kfb_trace_write(record, name, generation);
+    }
+
+    void finish(bool ok, long long bytes = 0, const void* buffer = nullptr) {
+        if(!active) return;
+        record.ok = ok;
+        record.bytes = bytes;
+        record.buffer = (uint64_t)(uintptr_t)buffer;
+    }
+
+    void slide(uint32_t slide) {
+        if(active) record.slide = slide;
+    }
+
+private:
+    bool active;
+    uint32_t generation;
+    KfbTraceRecord record;
+    const char* name;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/**
+ * Start recording kfbslide_* calls into @p path, replacing the current trace.
+ *
+ * @return false if the file cannot be created.
+ */
+bool kfbslide_trace_start(const char* path);
+
+// Flush all thread buffers and close the trace file.
+void kfbslide_trace_stop();
+#ifdef __cplusplus
+}
+#endif
+#endif
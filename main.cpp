@@ -1,10 +1,126 @@
 #include <iostream>
+#include <thread>
 #include "kfbreader.h"
+#include "kfbsampler.h"
+#include "kfbroi.h"
+#include "kfbdecode.h"
+#include "kfbstain.h"
+#include "kfbclient.h"
 
 using namespace std;
 
-int main() {
-    ImgHandle* s = kfbslide_open("lib/libImageOperationLib.so", "/nfs3-p1/hkw/PrognosisData/feulgenstain/预后差死亡复发组/A死亡复发组冰对 Feulgen/200615671.kfb");
+static bool sameBytes(const BYTE* a, ll na, const BYTE* b, ll nb) {
+    return a && b && na == nb && !memcmp(a, b, na);
+}
+
+// 通过 kfbdaemon 读取同一张切片, 结果应与本进程直接读取的字节一致
+static void checkDaemon(ImgHandle* s, const char* slidePath) {
+    RemoteHandle* r = kfbclient_open(nullptr, slidePath);
+    if(!r) {
+        cout << "cannot open the slide through kfbdaemon" << endl;
+        return;
+    }
+    int checked = 0, differ = 0;
+    ll w, h, rw, rh;
+    kfbslide_get_level_dimensions(s, 0, &w, &h);
+    kfbclient_get_level_dimensions(r, 0, &rw, &rh);
+    checked++;
+    if(w != rw || h != rh || kfbslide_get_level_count(s) != kfbclient_get_level_count(r)) differ++;
+    for(const char** name = kfbclient_get_associated_image_names(r); *name; name++) {
+        ll nBytes, rBytes;
+        kfbslide_get_associated_image_dimensions(s, *name, &w, &h, &nBytes);
+        kfbclient_get_associated_image_dimensions(r, *name, &rw, &rh, &rBytes);
+        BYTE* local = kfbslide_read_associated_image(s, *name);
+        BYTE* remote = kfbclient_read_associated_image(r, *name);
+        checked++;
+        if(!sameBytes(local, nBytes, remote, rBytes)) differ++;
+        kfbslide_buffer_free(s, local);
+        kfbclient_buffer_free(r, remote);
+    }
+    for(int i = 0; i < 8; i++) {
+        BYTE *local = nullptr, *remote = nullptr;
+        int nBytes = 0, rBytes = 0;
+        bool ok = i < 4 ? kfbslide_read_region(s, 0, i * 256, 0, &nBytes, &local)
+                        : kfbslide_get_image_roi_stream(s, 1, i * 512, 512, 300, 200, &nBytes, &local);
+        bool rok = i < 4 ? kfbclient_read_region(r, 0, i * 256, 0, &rBytes, &remote)
+                         : kfbclient_get_image_roi_stream(r, 1, i * 512, 512, 300, 200, &rBytes, &remote);
+        checked++;
+        if(ok != rok || (ok && !sameBytes(local, nBytes, remote, rBytes))) differ++;
+        kfbslide_buffer_free(s, local);
+        kfbclient_buffer_free(r, remote);
+    }
+    // 多个线程共用一个 RemoteHandle, 每个线程应拿到自己请求的块
+    atomic<int> threadDiffer(0);
+    vector<thread> readers;
+    for(int t = 0; t < 4; t++)
+        readers.emplace_back([&, t]() {
+            for(int i = 0; i < 8; i++) {
+                BYTE *local = nullptr, *remote = nullptr;
+                int nBytes = 0, rBytes = 0;
+                bool ok = kfbslide_read_region(s, 0, (t * 8 + i) * 256, 256, &nBytes, &local);
+                bool rok = kfbclient_read_region(r, 0, (t * 8 + i) * 256, 256, &rBytes, &remote);
+                if(ok != rok || (ok && !sameBytes(local, nBytes, remote, rBytes))) threadDiffer++;
+                kfbslide_buffer_free(s, local);
+                kfbclient_buffer_free(r, remote);
+            }
+        });
+    for(thread& t : readers) t.join();
+    checked += 32;
+    differ += threadDiffer;
+    cout << "checked " << checked << " reads through kfbdaemon, " << differ << " differ" << endl;
+    kfbclient_close(r);
+}
+
+// 用自身作参考归一化应得到原图; OD 与 HED 与逐像素的标量公式比较 (Ruifrok & Johnston 矩阵同 kfbstain.cpp)
+static void checkStain(ImgHandle* s) {
+    const int size = 512;
+    const ll n = (ll)size * size;
+    vector<BYTE> rgb(n * 3), out(n * 3);
+    if(!kfbslide_get_image_roi_rgb(s, 1, 0, 0, size, size, rgb.data())) {
+        cout << "Read Roi Error!" << endl;
+        return;
+    }
+    const int methods[2] = {KFB_STAIN_REINHARD, KFB_STAIN_MACENKO};
+    const char* methodNames[2] = {"reinhard", "macenko"};
+    for(int m = 0; m < 2; m++) {
+        if(!kfbslide_get_image_roi_normalized(s, s, methods[m], 1, 0, 0, size, size, out.data())) {
+            cout << methodNames[m] << ": no stain statistics" << endl;
+            continue;
+        }
+        int maxDiff = 0;
+        for(ll i = 0; i < n * 3; i++) maxDiff = max(maxDiff, abs(out[i] - rgb[i]));
+        cout << methodNames[m] << " against itself: max difference " << maxDiff;
+        // Macenko keeps only the part of OD in the H&E plane, so it does not give the input back
+        if(methods[m] == KFB_STAIN_REINHARD) cout << (maxDiff <= 1 ? "; ok" : "; MISMATCH");
+        cout << endl;
+    }
+
+    const float hedToRgb[3][3] = {{0.65f, 0.70f, 0.29f}, {0.07f, 0.99f, 0.11f}, {0.27f, 0.57f, 0.78f}};
+    vector<float> od(n * 3), hed(n * 3);
+    kfbslide_rgb_to_od(rgb.data(), n, od.data());
+    kfbslide_rgb_to_hed(rgb.data(), n, hed.data());
+    double odError = 0, hedError = 0;
+    for(ll i = 0; i < n * 3; i++) {
+        double expected = max(0.0, -log((rgb[i] + 1.0) / KFB_STAIN_IO));
+        odError = max(odError, fabs(od[i] - expected));
+        // OD = C * RGB_FROM_HED, row vectors
+        ll p = i / 3;
+        int c = i % 3;
+        double rebuilt = hed[3 * p] * hedToRgb[0][c] + hed[3 * p + 1] * hedToRgb[1][c] + hed[3 * p + 2] * hedToRgb[2][c];
+        hedError = max(hedError, fabs(rebuilt - expected));
+    }
+    cout << "od max error: " << odError << "; hed max error: " << hedError
+         << (odError < 1e-3 && hedError < 1e-3 ? "; ok" : "; MISMATCH") << endl;
+}
+
+int main(int argc, char** argv) {
+    const char* dllPath = argc > 1 ? argv[1] : "lib/libImageOperationLib.so";
+    const char* slidePath = argc > 2 ? argv[2] : "/nfs3-p1/hkw/PrognosisData/feulgenstain/预后差死亡复发组/A死亡复发组冰对 Feulgen/200615671.kfb";
+    ImgHandle* s = kfbslide_open(dllPath, slidePath);
+    if(!s) {
+        cout << "Cannot open " << slidePath << endl;
+        return EXIT_FAILURE;
+    }
     s->debug = true;
     cout << "Section 1: Associated Images" << endl;
     const char** sptr = kfbslide_get_associated_image_names(s);
@@ -72,6 +188,54 @@ int main() {
     }
     kfbslide_buffer_free(s, buf);
     cout << "Manually free 1 buffer" << endl;
+
+    cout << "Section 5: Patch sampler" << endl;
+    const int batchSize = 32, patchSize = 256;
+    vector<BYTE> batch(batchSize * 3 * patchSize * patchSize);
+    PatchSampler* sampler = kfbsampler_create(s, 1, patchSize, KFB_SAMPLE_TISSUE, 2023, 0);
+    if(sampler) {
+        for(int i = 0; i < 10; i++) kfbsampler_next_batch(sampler, batchSize, KFB_LAYOUT_CHW, batch.data(), nullptr);
+        cout << "patches/sec: " << kfbsampler_patches_per_second(sampler) << endl;
+        kfbsampler_destroy(sampler);
+    }
+
+    cout << "Section 6: Overlapping ROIs" << endl;
+    // 512 windows at a 256 stride on level 1
+    vector<KfbRoi> rois;
+    for(int wy = 0; wy < 4; wy++)
+        for(int wx = 0; wx < 4; wx++) rois.push_back(KfbRoi{wx * 256 * 2, wy * 256 * 2, 512, 512});
+    vector<vector<BYTE>> windows(rois.size(), vector<BYTE>(512 * 512 * 3));
+    vector<BYTE*> dests;
+    for(auto& w : windows) dests.push_back(w.data());
+    KfbRoiStats stats;
+    if(kfbslide_read_rois(s, 1, rois.data(), rois.size(), dests.data(), 0, &stats)) {
+        cout << "blocks: " << stats.blocks << "; amplification: " << stats.amplification
+             << "; per-window amplification: " << stats.naiveAmplification << endl;
+        // 每个窗口与单独解码的 ROI 比较, 两者的 JPEG 块边界不同, 只要求平均误差在 JPEG 噪声以内
+        vector<BYTE> single(512 * 512 * 3);
+        int differ = 0;
+        double worst = 0;
+        for(size_t i = 0; i < rois.size(); i++) {
+            if(!kfbslide_get_image_roi_rgb(s, 1, rois[i].x, rois[i].y, 512, 512, single.data())) {
+                differ++;
+                continue;
+            }
+            double sum = 0;
+            for(size_t k = 0; k < single.size(); k++) sum += abs(single[k] - windows[i][k]);
+            double mean = sum / single.size();
+            worst = max(worst, mean);
+            if(mean > 4) differ++;
+        }
+        cout << "checked " << rois.size() << " windows against single ROI reads, " << differ
+             << " differ; worst mean absolute difference: " << worst << endl;
+    }
+
+    cout << "Section 7: Stain normalization" << endl;
+    checkStain(s);
+
+    cout << "Section 8: kfbdaemon" << endl;
+    if(getenv("KFBD_SOCKET")) checkDaemon(s, slidePath);
+    else cout << "KFBD_SOCKET not set, skipped" << endl;
     kfbslide_close(s);
     return 0;
 }
\ No newline at end of file